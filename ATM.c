@@ -25,6 +25,7 @@ typedef struct data {
 	char operation[256];
     account_t account;
     char message[256];
+    int client;
 } data_t;
 
 // Structure for the message in the message queue
@@ -45,6 +46,7 @@ data_t message(int msqid, const char accountNo[], int encodedPIN, double funds,
     data.account.attempts = 0;
     strcpy(data.operation, operation);
     strcpy(data.message, "ATM");
+    data.client = getpid();
 
 	msg.mtype = 1;
 	msg.data = data;
@@ -195,6 +197,12 @@ int main(int argc, char *argv[]) {
                     strcpy(operation, "ACCOUNT"); 
                 }
 
+                // If the result is "THROTTLED", it will go back to the Account 
+                else if (strcmp(result.message, "THROTTLED") == 0) {
+                    printf("Too many invalid PINs, please try again later\n");
+                    strcpy(operation, "ACCOUNT"); 
+                }
+
                 // If the result is "NOT_EXIST", it will go back to the Account 
                 else if (strcmp(result.message, "NOT_EXIST") == 0) {
                     printf("Account does not exist\n");
@@ -0,0 +1,535 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <assert.h>
+
+// Maximum number of events handled per wake-up of the event loop
+#define MAX_EVENTS 256
+
+// Number of distinct reply messages counted
+#define MAX_MESSAGES 8
+
+// Time waited before retrying a send to a full message queue, in nanoseconds
+#define RETRY_DELAY 100000
+
+// Structure for the account details
+typedef struct account {
+    char accountNo[256];
+    int encodedPIN;
+    double funds;
+    int attempts;
+} account_t;
+
+// Structure for the data in the message
+typedef struct data {
+	char operation[256];
+    account_t account;
+    char message[256];
+    int client;
+} data_t;
+
+// Structure for the message in the message queue
+struct message {
+    long mtype;
+    data_t data;
+};
+
+// Connection of a simulated client to the socket front-end
+typedef struct connection {
+    int fd;
+    char in[sizeof(data_t)];    // Partially received reply
+    size_t in_length;
+    double sent_at;             // Time the request in flight was sent
+} connection_t;
+
+// Number of replies received with one message
+typedef struct tally {
+    char message[16];
+    long count;
+} tally_t;
+
+/**
+ * Counts a reply by its message. Messages beyond the size of the tally are counted in its last entry.
+ *
+ * @param tally    The tally, with an empty message marking the unused entries.
+ * @param message  The message of the reply.
+ */
+void count_reply(tally_t tally[MAX_MESSAGES], const char message[]) {
+    int i = 0;
+    while (i < MAX_MESSAGES - 1 && tally[i].message[0] != '\0' &&
+           strncmp(tally[i].message, message, sizeof(tally[i].message) - 1) != 0) {
+        i++;
+    }
+    if (tally[i].message[0] == '\0') {
+        strncpy(tally[i].message, message, sizeof(tally[i].message) - 1);
+    }
+    tally[i].count++;
+}
+
+/**
+ * Returns the current time in seconds.
+ *
+ * @return  The value of the monotonic clock, in seconds.
+ */
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Waits a little before retrying a send to a full message queue, so that the CPU is left to the
+ * server instead of spinning.
+ */
+void back_off(void) {
+    struct timespec ts = {0, RETRY_DELAY};
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Opens the message queue of the server.
+ *
+ * @return  The identifier of the message queue.
+ */
+int open_queue(void) {
+    char abs_path[100];
+    realpath("key_file.txt", abs_path);
+    key_t key = ftok(abs_path, 1);
+
+    if (key == -1) {
+        perror("key");
+        exit(1);
+    }
+
+    int msqid = msgget(key, IPC_CREAT | 0644);
+
+    if (msqid == -1) {
+        perror("msgget");
+        exit(1);
+    }
+
+    return msqid;
+}
+
+/**
+ * Sends requests through the message queue from this single process, pipelining up to the given
+ * number of requests. The queue only holds about 20 messages, so fewer are in flight when more are
+ * asked for; this measures a pipelined client, not concurrent ones.
+ *
+ * @param request    The request to send.
+ * @param inflight   The number of requests to keep in flight.
+ * @param requests   The total number of requests to send.
+ * @param latencies  Filled with the latency of every request, in seconds.
+ * @param tally      Counts the replies by message.
+ */
+void bench_pipeline(const data_t *request, int inflight, long requests, double *latencies, tally_t *tally) {
+    int msqid = open_queue();
+    struct message msg;
+    int msg_length = sizeof(msg) - sizeof(long);
+    long sent = 0;
+    long received = 0;
+
+    while (received < requests) {
+        // Top up the requests in flight, then wait for one reply. The queue only holds a few
+        // messages, so stop early rather than block while it is full
+        while (sent < requests && sent - received < inflight) {
+            msg.mtype = 1;
+            msg.data = *request;
+            latencies[sent] = now();
+            if (msgsnd(msqid, &msg, msg_length, IPC_NOWAIT) == -1) {
+                if (errno == EAGAIN || errno == EINTR) {
+                    break;
+                }
+                perror("msgsnd");
+                exit(1);
+            }
+            sent++;
+        }
+
+        if (sent == received) {
+            back_off();
+            continue;
+        }
+
+        if (msgrcv(msqid, &msg, msg_length, 2, 0) == -1) {
+            perror("msgrcv");
+            exit(1);
+        }
+
+        // The server replies in order, so this is the reply to the oldest request in flight
+        latencies[received] = now() - latencies[received];
+        count_reply(tally, msg.data.message);
+        received++;
+    }
+}
+
+/**
+ * Sends requests through the message queue from one client process, one request at a time.
+ *
+ * @param msqid      The identifier of the message queue.
+ * @param request    The request to send.
+ * @param first      The index of the first request of this client.
+ * @param step       The number of clients, by which the indexes of its requests are apart.
+ * @param requests   The total number of requests of all clients.
+ * @param latencies  Filled with the latency of every request of this client, in seconds.
+ * @param tally      Counts the replies of this client by message.
+ */
+void run_queue_client(int msqid, const data_t *request, long first, long step, long requests,
+                      double *latencies, tally_t *tally) {
+    struct message msg;
+    int msg_length = sizeof(msg) - sizeof(long);
+
+    for (long i = first; i < requests; i += step) {
+        msg.mtype = 1;
+        msg.data = *request;
+        msg.data.client = getpid();
+        latencies[i] = now();
+
+        // Blocks while the queue is full, as the ATMs do
+        if (msgsnd(msqid, &msg, msg_length, 0) == -1) {
+            perror("msgsnd");
+            exit(1);
+        }
+        if (msgrcv(msqid, &msg, msg_length, 2, 0) == -1) {
+            perror("msgrcv");
+            exit(1);
+        }
+
+        latencies[i] = now() - latencies[i];
+        count_reply(tally, msg.data.message);
+    }
+}
+
+/**
+ * Sends requests through the message queue from the given number of client processes, each with
+ * one request in flight, like the socket clients. Replies are not addressed to a client, so a
+ * process may take the reply to the request of another. Every reply to the same request is the
+ * same, so the throughput holds; a latency is the time until the process got a reply.
+ *
+ * @param request    The request to send.
+ * @param clients    The number of client processes.
+ * @param requests   The total number of requests to send.
+ * @param latencies  Filled with the latency of every request, in seconds.
+ * @param tally      Counts the replies by message.
+ * @return           The time the clients were started, in seconds.
+ */
+double bench_queue(const data_t *request, int clients, long requests, double *latencies, tally_t *tally) {
+    int msqid = open_queue();
+    int gate[2];
+
+    // The clients write their latencies and replies where this process can read them
+    size_t latencies_size = requests * sizeof(double);
+    size_t tallies_size = (size_t)clients * MAX_MESSAGES * sizeof(tally_t);
+    double *shared_latencies = mmap(NULL, latencies_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    tally_t *tallies = mmap(NULL, tallies_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (shared_latencies == MAP_FAILED || tallies == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (pipe(gate) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+
+    // Every client waits for the gate to close, so that forking them is not measured
+    for (int i = 0; i < clients; i++) {
+        pid_t pid = fork();
+
+        if (pid == -1) {
+            perror("fork");
+            exit(1);
+        }
+
+        if (pid == 0) {
+            char byte;
+
+            // Never outlive the benchmark, or leftover clients would take the replies of the next run
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            close(gate[1]);
+            if (read(gate[0], &byte, 1) == -1) {
+                perror("read");
+                exit(1);
+            }
+            run_queue_client(msqid, request, i, clients, requests, shared_latencies, &tallies[i * MAX_MESSAGES]);
+            exit(0);
+        }
+    }
+
+    double start = now();
+    close(gate[1]);
+    close(gate[0]);
+
+    int status;
+    while (wait(&status) != -1) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "A client failed\n");
+            exit(1);
+        }
+    }
+
+    memcpy(latencies, shared_latencies, latencies_size);
+    for (int i = 0; i < clients * MAX_MESSAGES; i++) {
+        for (long n = 0; n < tallies[i].count; n++) {
+            count_reply(tally, tallies[i].message);
+        }
+    }
+
+    munmap(shared_latencies, latencies_size);
+    munmap(tallies, tallies_size);
+    return start;
+}
+
+/**
+ * Opens a connection to the socket front-end of the server.
+ *
+ * @param unix_path  The path of the Unix domain socket, or NULL to use TCP.
+ * @param tcp_port   The TCP port on the loopback interface.
+ * @return           The connected socket.
+ */
+int connect_server(const char unix_path[], int tcp_port) {
+    int fd;
+
+    if (unix_path != NULL) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            perror("connect");
+            exit(1);
+        }
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(tcp_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            perror("connect");
+            exit(1);
+        }
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    return fd;
+}
+
+/**
+ * Sends requests through the socket front-end, one connection and one request in flight per client.
+ *
+ * @param request    The request to send.
+ * @param clients    The number of concurrent clients.
+ * @param requests   The total number of requests to send.
+ * @param unix_path  The path of the Unix domain socket, or NULL to use TCP.
+ * @param tcp_port   The TCP port on the loopback interface.
+ * @param latencies  Filled with the latency of every request, in seconds.
+ * @param tally      Counts the replies by message.
+ */
+void bench_socket(const data_t *request, int clients, long requests, const char unix_path[], int tcp_port,
+                  double *latencies, tally_t *tally) {
+    int epfd = epoll_create1(0);
+    connection_t *conns = calloc(clients, sizeof(connection_t));
+    assert(conns != NULL);
+
+    if (epfd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    for (int i = 0; i < clients; i++) {
+        conns[i].fd = connect_server(unix_path, tcp_port);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = &conns[i];
+        epoll_ctl(epfd, EPOLL_CTL_ADD, conns[i].fd, &event);
+    }
+
+    long sent = 0;
+    long received = 0;
+
+    // Every client starts with one request; the sockets are blocking, so writes are whole
+    for (int i = 0; i < clients && sent < requests; i++, sent++) {
+        conns[i].sent_at = now();
+        if (write(conns[i].fd, request, sizeof(data_t)) != sizeof(data_t)) {
+            perror("write");
+            exit(1);
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (received < requests) {
+        int count = epoll_wait(epfd, events, MAX_EVENTS, -1);
+
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < count; i++) {
+            connection_t *conn = events[i].data.ptr;
+            ssize_t n = read(conn->fd, conn->in + conn->in_length, sizeof(conn->in) - conn->in_length);
+
+            if (n <= 0) {
+                fprintf(stderr, "Connection closed by the server\n");
+                exit(1);
+            }
+
+            conn->in_length += n;
+            if (conn->in_length < sizeof(conn->in)) {
+                continue;
+            }
+            conn->in_length = 0;
+            latencies[received++] = now() - conn->sent_at;
+            count_reply(tally, conn->in + offsetof(data_t, message));
+
+            if (sent < requests) {
+                conn->sent_at = now();
+                if (write(conn->fd, request, sizeof(data_t)) != sizeof(data_t)) {
+                    perror("write");
+                    exit(1);
+                }
+                sent++;
+            }
+        }
+    }
+
+    for (int i = 0; i < clients; i++) {
+        close(conns[i].fd);
+    }
+    free(conns);
+    close(epfd);
+}
+
+/**
+ * Compares two latencies, for sorting.
+ *
+ * @param a  A pointer to the first latency.
+ * @param b  A pointer to the second latency.
+ * @return   A negative, zero or positive value as the first latency is smaller, equal or larger.
+ */
+int compare_latencies(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+    char *mode = "queue";
+    char *unix_path = "DBserver.sock";
+    char *accountNo = "00001";
+    char *operation = "BALANCE";
+    int tcp_port = 5000;
+    int clients = 1;
+    long requests = 100000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:c:n:u:t:a:o:")) != -1) {
+        if (opt == 'm') {
+            mode = optarg;
+        } else if (opt == 'c') {
+            clients = atoi(optarg);
+        } else if (opt == 'n') {
+            requests = atol(optarg);
+        } else if (opt == 'u') {
+            unix_path = optarg;
+        } else if (opt == 't') {
+            tcp_port = atoi(optarg);
+        } else if (opt == 'a') {
+            accountNo = optarg;
+        } else if (opt == 'o') {
+            operation = optarg;
+        } else {
+            fprintf(stderr, "Usage: %s [-m queue|pipeline|unix|tcp] [-c clients] [-n requests] [-u unix_socket_path] "
+                            "[-t tcp_port] [-a account] [-o operation]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    if (clients < 1 || requests < 1) {
+        fprintf(stderr, "The number of clients and requests must be positive\n");
+        exit(1);
+    }
+
+    // Allow one socket, or one process on the message queue, per simulated client
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (getrlimit(RLIMIT_NPROC, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NPROC, &limit);
+    }
+
+    // Request sent by every client; the PIN and funds are only read by the PIN and WITHDRAW operations
+    data_t request;
+    memset(&request, 0, sizeof(request));
+    strncpy(request.account.accountNo, accountNo, sizeof(request.account.accountNo) - 1);
+    strncpy(request.operation, operation, sizeof(request.operation) - 1);
+    strcpy(request.message, "ATM");
+    request.client = getpid();
+
+    double *latencies = malloc(requests * sizeof(double));
+    assert(latencies != NULL);
+    tally_t tally[MAX_MESSAGES];
+    memset(tally, 0, sizeof(tally));
+    double start = now();
+
+    if (strcmp(mode, "queue") == 0) {
+        start = bench_queue(&request, clients, requests, latencies, tally);
+    } else if (strcmp(mode, "pipeline") == 0) {
+        bench_pipeline(&request, clients, requests, latencies, tally);
+    } else if (strcmp(mode, "unix") == 0) {
+        bench_socket(&request, clients, requests, unix_path, 0, latencies, tally);
+    } else if (strcmp(mode, "tcp") == 0) {
+        bench_socket(&request, clients, requests, NULL, tcp_port, latencies, tally);
+    } else {
+        fprintf(stderr, "Unknown mode: %s\n", mode);
+        exit(1);
+    }
+
+    double elapsed = now() - start;
+    printf("%s %s=%d requests=%ld seconds=%.3f requests/s=%.0f\n", mode,
+           strcmp(mode, "pipeline") == 0 ? "pipelined" : "clients", clients, requests, elapsed, requests / elapsed);
+
+    qsort(latencies, requests, sizeof(double), compare_latencies);
+    printf("latency us p50=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+           latencies[requests / 2] * 1e6, latencies[requests * 99 / 100] * 1e6,
+           latencies[requests * 999 / 1000] * 1e6, latencies[requests - 1] * 1e6);
+
+    printf("replies");
+    for (int i = 0; i < MAX_MESSAGES && tally[i].message[0] != '\0'; i++) {
+        printf(" %s=%ld", tally[i].message, tally[i].count);
+    }
+    printf("\n");
+    free(latencies);
+
+    return 0;
+}
@@ -25,6 +25,7 @@ typedef struct data {
 	char operation[256];
     account_t account;
     char message[256];
+    int client;
 } data_t;
 
 // Structure for the message in the message queue
@@ -125,6 +126,7 @@ int main(int argc, char *argv[]) {
         data.account.funds = funds_available;
         strcpy(data.operation, "UPDATE_DB");
         strcpy(data.message, "DBeditor");
+        data.client = getpid();
 
         msg.data = data;
 
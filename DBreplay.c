@@ -0,0 +1,682 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <assert.h>
+
+// Magic number at the start of a trace file
+#define TRACE_MAGIC "ATMTRC2"
+
+// Number of mismatching replies printed before only counting them
+#define MAX_REPORTED 10
+
+// Time waited before retrying a send to a full message queue, in nanoseconds
+#define RETRY_DELAY 100000
+
+// Number of wrong PIN entries after which an account is blocked
+#define MAX_ATTEMPTS 3
+
+// Types of the journal records
+#define JOURNAL_ATTEMPTS 1
+#define JOURNAL_ACCOUNT 2
+#define JOURNAL_RESET 3
+
+// Magic number at the start of a journal, followed by the version of its layout
+#define JOURNAL_MAGIC "ATMJRNL"
+#define JOURNAL_VERSION 1
+
+// Structure for the account details
+typedef struct account {
+    char accountNo[256];
+    int encodedPIN;
+    double funds;
+    int attempts;
+} account_t;
+
+// Structure for the data in the message
+typedef struct data {
+	char operation[256];
+    account_t account;
+    char message[256];
+    int client;
+} data_t;
+
+// Structure for the message in the message queue
+struct message {
+    long mtype;
+    data_t data;
+};
+
+// Request and reply recorded in a trace, with the operation and messages truncated to keep records
+// compact
+typedef struct trace_record {
+    uint64_t time;              // Nanoseconds since the server started
+    char operation[16];
+    char accountNo[256];        // As long as in account_t, so that no account number is cut short
+    char message[16];
+    int32_t encodedPIN;
+    int32_t client;
+    double funds;
+    char reply[16];             // Message of the reply, empty if there was no reply
+    double reply_funds;
+} trace_record_t;
+
+// Record appended to the journal whenever the attempts of an account change, or in shard mode
+// whenever its PIN or funds change
+typedef struct journal_record {
+    char accountNo[256];
+    int32_t type;
+    int32_t value;              // Attempts, or encoded PIN for an account record
+    double funds;
+} journal_record_t;
+
+// Header at the start of the journal
+typedef struct journal_header {
+    char magic[sizeof(JOURNAL_MAGIC)];
+    int32_t version;
+    int32_t record_size;
+} journal_header_t;
+
+// Accounts of a data file with the lockout state and account changes of its journal applied
+typedef struct state {
+    account_t *accounts;
+    long count;
+    long capacity;
+} state_t;
+
+// Connection to the server being replayed against, over the message queue or a socket
+typedef struct target {
+    int msqid;                  // Message queue, or -1 when using a socket
+    int fd;                     // Socket, or -1 when using the message queue
+} target_t;
+
+/**
+ * Returns the current time in seconds.
+ *
+ * @return  The value of the monotonic clock, in seconds.
+ */
+double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Waits a little before retrying a send to a full message queue, so that the CPU is left to the
+ * server instead of spinning.
+ */
+void back_off(void) {
+    struct timespec ts = {0, RETRY_DELAY};
+    nanosleep(&ts, NULL);
+}
+
+/**
+ * Reads every record of a trace file.
+ *
+ * @param filename  The name of the trace file.
+ * @param count     Set to the number of records read.
+ * @return          The records, allocated on the heap.
+ */
+trace_record_t *read_trace(const char filename[], long *count) {
+    char magic[sizeof(TRACE_MAGIC)];
+    FILE *file = fopen(filename, "rb");
+
+    if (file == NULL) {
+        printf("Failed to open the trace.\n");
+        exit(1);
+    }
+
+    if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0) {
+        printf("Not a trace file: %s\n", filename);
+        exit(1);
+    }
+
+    long capacity = 1024;
+    trace_record_t *records = malloc(capacity * sizeof(trace_record_t));
+    assert(records != NULL);
+    *count = 0;
+
+    while (fread(&records[*count], sizeof(trace_record_t), 1, file) == 1) {
+        if (++*count == capacity) {
+            capacity *= 2;
+            records = realloc(records, capacity * sizeof(trace_record_t));
+            assert(records != NULL);
+        }
+    }
+
+    fclose(file);
+    return records;
+}
+
+/**
+ * Opens the message queue or the socket of the server.
+ *
+ * @param mode       "queue", "unix" or "tcp".
+ * @param unix_path  The path of the Unix domain socket.
+ * @param tcp_port   The TCP port on the loopback interface.
+ * @return           The connection to the server.
+ */
+target_t open_target(const char mode[], const char unix_path[], int tcp_port) {
+    target_t target = {-1, -1};
+
+    if (strcmp(mode, "queue") == 0) {
+        char abs_path[100];
+        realpath("key_file.txt", abs_path);
+        key_t key = ftok(abs_path, 1);
+
+        if (key == -1) {
+            perror("key");
+            exit(1);
+        }
+
+        target.msqid = msgget(key, IPC_CREAT | 0644);
+
+        if (target.msqid == -1) {
+            perror("msgget");
+            exit(1);
+        }
+    }
+
+    else if (strcmp(mode, "unix") == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+        target.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (target.fd == -1 || connect(target.fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            perror("connect");
+            exit(1);
+        }
+    }
+
+    else if (strcmp(mode, "tcp") == 0) {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(tcp_port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        target.fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (target.fd == -1 || connect(target.fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            perror("connect");
+            exit(1);
+        }
+        int on = 1;
+        setsockopt(target.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    else {
+        fprintf(stderr, "Unknown mode: %s\n", mode);
+        exit(1);
+    }
+
+    return target;
+}
+
+/**
+ * Sends a request to the server.
+ *
+ * @param target  The connection to the server.
+ * @param data    The request.
+ * @return        0 on success, -1 if the message queue is full and the request was not sent.
+ */
+int send_request(target_t target, const data_t *data) {
+    if (target.msqid != -1) {
+        struct message msg;
+        int msg_length = sizeof(msg) - sizeof(long);
+        msg.mtype = 1;
+        msg.data = *data;
+
+        // The queue only holds a few messages, so never block while it is full of replies
+        if (msgsnd(target.msqid, &msg, msg_length, IPC_NOWAIT) == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                return -1;
+            }
+            perror("msgsnd");
+            exit(1);
+        }
+        return 0;
+    }
+
+    size_t sent = 0;
+    while (sent < sizeof(data_t)) {
+        ssize_t n = write(target.fd, (const char *)data + sent, sizeof(data_t) - sent);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            exit(1);
+        }
+        sent += n;
+    }
+    return 0;
+}
+
+/**
+ * Receives the next reply from the server.
+ *
+ * @param target  The connection to the server.
+ * @param data    Filled with the reply.
+ */
+void receive_reply(target_t target, data_t *data) {
+    if (target.msqid != -1) {
+        struct message msg;
+        int msg_length = sizeof(msg) - sizeof(long);
+
+        if (msgrcv(target.msqid, &msg, msg_length, 2, 0) == -1) {
+            perror("msgrcv");
+            exit(1);
+        }
+        *data = msg.data;
+        return;
+    }
+
+    size_t received = 0;
+    while (received < sizeof(data_t)) {
+        ssize_t n = read(target.fd, (char *)data + received, sizeof(data_t) - received);
+        if (n == 0) {
+            fprintf(stderr, "Connection closed by the server\n");
+            exit(1);
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            exit(1);
+        }
+        received += n;
+    }
+}
+
+/**
+ * Checks a reply against the reply recorded in the trace.
+ *
+ * @param record      The recorded request and reply.
+ * @param data        The reply received during the replay.
+ * @param mismatches  The number of mismatches so far, incremented if the replies differ.
+ */
+void check_reply(const trace_record_t *record, const data_t *data, long *mismatches) {
+    if (strncmp(record->reply, data->message, sizeof(record->reply) - 1) == 0 &&
+        fabs(record->reply_funds - data->account.funds) < 0.005) {
+        return;
+    }
+
+    if (++*mismatches <= MAX_REPORTED) {
+        printf("Mismatch on %s %s: recorded %s %.2lf, replayed %s %.2lf\n",
+               record->operation, record->accountNo, record->reply, record->reply_funds,
+               data->message, data->account.funds);
+    }
+}
+
+/**
+ * Removes white spaces from a string.
+ *
+ * @param str The string to remove white spaces from.
+ */
+void removeWhiteSpace(char *str) {
+    int i, j = 0;
+    for (i = 0; str[i] != '\0'; ++i) {
+        if (str[i] != ' ' && str[i] != '\n') {
+            str[j++] = str[i];
+        }
+    }
+    str[j] = '\0';
+}
+
+/**
+ * Compares two accounts by account number, for sorting.
+ *
+ * @param a  A pointer to the first account.
+ * @param b  A pointer to the second account.
+ * @return   A negative, zero or positive value as the first account number sorts before, with or after.
+ */
+int compare_accounts(const void *a, const void *b) {
+    return strcmp(((const account_t *)a)->accountNo, ((const account_t *)b)->accountNo);
+}
+
+/**
+ * Adds an account at the end of a state.
+ *
+ * @param state      A pointer to the state.
+ * @param accountNo  The account number.
+ * @return           A pointer to the new account.
+ */
+account_t *state_add(state_t *state, const char accountNo[]) {
+    if (state->count == state->capacity) {
+        state->capacity = state->capacity == 0 ? 64 : 2 * state->capacity;
+        state->accounts = realloc(state->accounts, state->capacity * sizeof(account_t));
+        assert(state->accounts != NULL);
+    }
+    account_t *account = &state->accounts[state->count++];
+    memset(account, 0, sizeof(*account));
+    strncpy(account->accountNo, accountNo, sizeof(account->accountNo) - 1);
+    return account;
+}
+
+/**
+ * Finds an account of a state whose first accounts are sorted by account number.
+ *
+ * @param state      A pointer to the state.
+ * @param sorted     The number of sorted accounts; the few added after them are searched one by one.
+ * @param accountNo  The account number.
+ * @return           A pointer to the account, or NULL if not found.
+ */
+account_t *state_find(state_t *state, long sorted, const char accountNo[]) {
+    account_t key;
+    strncpy(key.accountNo, accountNo, sizeof(key.accountNo) - 1);
+    key.accountNo[sizeof(key.accountNo) - 1] = '\0';
+
+    account_t *account = bsearch(&key, state->accounts, sorted, sizeof(account_t), compare_accounts);
+    for (long i = sorted; account == NULL && i < state->count; i++) {
+        if (strcmp(state->accounts[i].accountNo, accountNo) == 0) {
+            account = &state->accounts[i];
+        }
+    }
+    return account;
+}
+
+/**
+ * Reads the accounts of a data file and applies its journal, the way the server does on startup:
+ * attempts records of unknown accounts are ignored, account records create missing accounts, and
+ * account records before the last reset are skipped since a reload wrote them to the data file.
+ *
+ * @param data_file  The name of the data file.
+ * @param journal    The name of the journal file.
+ * @param state      Filled with the accounts, sorted by account number.
+ * @return           0 on success, -1 if the data file cannot be read or the journal is damaged.
+ */
+int load_state(const char data_file[], const char journal[], state_t *state) {
+    char buffer[1024];
+    char accountNo[256];
+    int encodedPIN;
+    double funds;
+    journal_record_t record;
+
+    memset(state, 0, sizeof(*state));
+    FILE *file = fopen(data_file, "r");
+
+    if (file == NULL) {
+        return -1;
+    }
+
+    if (fgets(buffer, sizeof(buffer), file) != NULL) {
+        while (fscanf(file, "%255[^,],%d,%lf", accountNo, &encodedPIN, &funds) == 3) {
+            removeWhiteSpace(accountNo);
+            account_t *account = state_add(state, accountNo);
+            account->encodedPIN = encodedPIN;
+            account->funds = funds;
+        }
+    }
+    fclose(file);
+
+    long sorted = state->count;
+    qsort(state->accounts, sorted, sizeof(account_t), compare_accounts);
+
+    // A missing journal holds no lockout state
+    file = fopen(journal, "rb");
+
+    if (file != NULL) {
+        journal_header_t header;
+        size_t length = fread(&header, 1, sizeof(header), file);
+        int damaged = length != 0 && (length != sizeof(header) ||
+                                      memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+                                      header.version != JOURNAL_VERSION ||
+                                      header.record_size != sizeof(journal_record_t));
+
+        long start = ftell(file);
+        long position = 0;
+        long reset = 0;
+
+        // Check every record and find the last reset before applying any
+        while (!damaged && (length = fread(&record, 1, sizeof(record), file)) == sizeof(record)) {
+            position++;
+            if (record.type == JOURNAL_RESET) {
+                reset = position;
+            } else if (!(record.type == JOURNAL_ATTEMPTS && record.value >= 0 && record.value <= MAX_ATTEMPTS) &&
+                       !(record.type == JOURNAL_ACCOUNT && isfinite(record.funds))) {
+                damaged = 1;
+            }
+        }
+        damaged = damaged || length != 0;
+        fseek(file, start, SEEK_SET);
+
+        for (position = 0; !damaged && fread(&record, sizeof(record), 1, file) == 1; position++) {
+            record.accountNo[sizeof(record.accountNo) - 1] = '\0';
+            account_t *account = state_find(state, sorted, record.accountNo);
+
+            if (record.type == JOURNAL_ATTEMPTS && account != NULL) {
+                account->attempts = record.value;
+            } else if (record.type == JOURNAL_ACCOUNT && position >= reset) {
+                if (account == NULL) {
+                    account = state_add(state, record.accountNo);
+                }
+                account->encodedPIN = record.value;
+                account->funds = record.funds;
+            }
+        }
+        fclose(file);
+
+        if (damaged) {
+            free(state->accounts);
+            return -1;
+        }
+    }
+
+    qsort(state->accounts, state->count, sizeof(account_t), compare_accounts);
+    return 0;
+}
+
+/**
+ * Compares the final state of the accounts, including their lockout state, with the expected one.
+ *
+ * @param expected  A pointer to the expected state.
+ * @param actual    A pointer to the actual state.
+ * @return          The number of accounts that differ.
+ */
+long compare_states(const state_t *expected, const state_t *actual) {
+    long i = 0;
+    long j = 0;
+    long differences = 0;
+
+    while (i < expected->count || j < actual->count) {
+        const account_t *a = i < expected->count ? &expected->accounts[i] : NULL;
+        const account_t *b = j < actual->count ? &actual->accounts[j] : NULL;
+        int order = a == NULL ? 1 : b == NULL ? -1 : strcmp(a->accountNo, b->accountNo);
+        const char *problem = NULL;
+
+        if (order < 0) {
+            problem = "missing";
+            i++;
+        } else if (order > 0) {
+            problem = "unexpected";
+            a = b;
+            j++;
+        } else {
+            if (a->encodedPIN != b->encodedPIN || fabs(a->funds - b->funds) >= 0.005) {
+                problem = "has other details";
+            } else if (a->attempts != b->attempts) {
+                problem = "has another lockout state";
+            }
+            i++;
+            j++;
+        }
+
+        if (problem != NULL && ++differences <= MAX_REPORTED) {
+            printf("Account %s %s", a->accountNo, problem);
+            if (order == 0) {
+                printf(": expected PIN %d, %.2lf, %d attempts; replayed PIN %d, %.2lf, %d attempts",
+                       a->encodedPIN, a->funds, a->attempts, b->encodedPIN, b->funds, b->attempts);
+            }
+            printf("\n");
+        }
+    }
+
+    return differences;
+}
+
+int main(int argc, char *argv[]) {
+    char *trace_path = NULL;
+    char *mode = "queue";
+    char *unix_path = "DBserver.sock";
+    char *expected = NULL;
+    char *expected_journal = NULL;
+    char *data_file = "DataBase.csv";
+    char *journal = "DataBase.journal";
+    int tcp_port = 5000;
+    double speed = 1;
+    long window = 64;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:m:u:t:s:w:e:j:d:J:")) != -1) {
+        if (opt == 'i') {
+            trace_path = optarg;
+        } else if (opt == 'm') {
+            mode = optarg;
+        } else if (opt == 'u') {
+            unix_path = optarg;
+        } else if (opt == 't') {
+            tcp_port = atoi(optarg);
+        } else if (opt == 's') {
+            speed = atof(optarg);
+        } else if (opt == 'w') {
+            window = atol(optarg);
+        } else if (opt == 'e') {
+            expected = optarg;
+        } else if (opt == 'j') {
+            expected_journal = optarg;
+        } else if (opt == 'd') {
+            data_file = optarg;
+        } else if (opt == 'J') {
+            journal = optarg;
+        } else {
+            trace_path = NULL;
+            break;
+        }
+    }
+
+    // The final state includes the lockout state, so an expected data file comes with its journal
+    if (trace_path == NULL || window < 1 || speed < 0 || (expected == NULL) != (expected_journal == NULL)) {
+        fprintf(stderr, "Usage: %s -i trace_file [-m queue|unix|tcp] [-u unix_socket_path] [-t tcp_port] "
+                        "[-s speed, 0 for as fast as possible] [-w window] [-e expected_data_file "
+                        "-j expected_journal] [-d data_file] [-J journal]\n", argv[0]);
+        exit(1);
+    }
+
+    long count;
+    trace_record_t *records = read_trace(trace_path, &count);
+    target_t target = open_target(mode, unix_path, tcp_port);
+
+    // Records still waiting for their reply, oldest first; the server replies in order
+    long *pending = malloc(window * sizeof(long));
+    assert(pending != NULL);
+    long pending_front = 0;
+    long pending_count = 0;
+    long mismatches = 0;
+    data_t data;
+
+    double start = now();
+
+    for (long i = 0; i < count; i++) {
+        const trace_record_t *record = &records[i];
+
+        // Wait until the request is due, relative to the first one
+        if (speed > 0) {
+            double due = start + (record->time - records[0].time) / 1e9 / speed;
+            double delay = due - now();
+            if (delay > 0) {
+                struct timespec ts;
+                ts.tv_sec = (time_t)delay;
+                ts.tv_nsec = (long)((delay - ts.tv_sec) * 1e9);
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        memset(&data, 0, sizeof(data));
+        strncpy(data.operation, record->operation, sizeof(record->operation) - 1);
+        strncpy(data.account.accountNo, record->accountNo, sizeof(record->accountNo) - 1);
+        strncpy(data.message, record->message, sizeof(record->message) - 1);
+        data.account.encodedPIN = record->encodedPIN;
+        data.account.funds = record->funds;
+        data.client = record->client;
+
+        // Collect the oldest reply while the window is full or the message queue has no room
+        while (pending_count == window || send_request(target, &data) == -1) {
+            if (pending_count == 0) {
+                back_off();
+                continue;
+            }
+            data_t reply;
+            receive_reply(target, &reply);
+            check_reply(&records[pending[pending_front]], &reply, &mismatches);
+            pending_front = (pending_front + 1) % window;
+            pending_count--;
+        }
+
+        if (record->reply[0] != '\0') {
+            pending[(pending_front + pending_count) % window] = i;
+            pending_count++;
+        }
+    }
+
+    while (pending_count > 0) {
+        data_t reply;
+        receive_reply(target, &reply);
+        check_reply(&records[pending[pending_front]], &reply, &mismatches);
+        pending_front = (pending_front + 1) % window;
+        pending_count--;
+    }
+
+    double elapsed = now() - start;
+
+    // Requests are handled in order, so once a last request is answered every recorded one is applied
+    memset(&data, 0, sizeof(data));
+    strcpy(data.operation, "BALANCE");
+    strcpy(data.message, "ATM");
+    while (send_request(target, &data) == -1) {
+        back_off();
+    }
+    receive_reply(target, &data);
+
+    printf("replayed=%ld seconds=%.3f requests/s=%.0f mismatches=%ld\n",
+           count, elapsed, elapsed > 0 ? count / elapsed : 0, mismatches);
+
+    int status = mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (expected != NULL) {
+        state_t want;
+        state_t got;
+
+        if (load_state(expected, expected_journal, &want) == -1 || load_state(data_file, journal, &got) == -1) {
+            printf("Failed to read the data files or their journals.\n");
+            exit(1);
+        }
+
+        long differences = compare_states(&want, &got);
+        if (differences == 0) {
+            printf("Final state matches %s and %s\n", expected, expected_journal);
+        } else {
+            printf("Final state of %ld accounts differs from %s and %s\n", differences, expected, expected_journal);
+            status = EXIT_FAILURE;
+        }
+        free(want.accounts);
+        free(got.accounts);
+    }
+
+    free(pending);
+    free(records);
+    return status;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,6 +12,77 @@
 #include <fcntl.h>
 #include <sys/msg.h>
 #include <assert.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sched.h>
+#include <stdint.h>
+#include <limits.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+// Number of wrong PIN entries after which an account is blocked
+#define MAX_ATTEMPTS 3
+
+// Length of the per-client throttling window, in seconds
+#define THROTTLE_WINDOW 60
+
+// Number of wrong PIN entries a single client may make within one window
+#define THROTTLE_LIMIT 10
+
+// Number of client slots tracked by the throttle (must be a power of two)
+#define THROTTLE_SLOTS 4096
+
+// Append-only file that persists the lockout state between server runs, and the account
+// changes made in shard mode until they are written back to the data file
+#define JOURNAL_FILE "DataBase.journal"
+
+// Types of the journal records
+#define JOURNAL_ATTEMPTS 1
+#define JOURNAL_ACCOUNT 2
+#define JOURNAL_RESET 3
+
+// Magic number at the start of a journal, followed by the version of its layout
+#define JOURNAL_MAGIC "ATMJRNL"
+#define JOURNAL_VERSION 1
+
+// Maximum number of events handled per wake-up of the event loop
+#define MAX_EVENTS 256
+
+// Bytes of replies, waiting to be written or still to come from the shards, past which a connection
+// is no longer read until its client catches up
+#define OUTPUT_LIMIT (256 * sizeof(data_t))
+
+// Magic number at the start of a trace file
+#define TRACE_MAGIC "ATMTRC2"
+
+// Number of jobs each per-core queue can hold (must be a power of two)
+#define RING_SIZE 4096
+
+// Number of times an idle shard polls its queue before going to sleep
+#define SPIN_LIMIT 200
+
+// Number of jobs a shard handles before telling the event loop that replies are ready
+#define REPLY_BATCH 64
+
+// Kinds of jobs sent to a shard
+#define JOB_REQUEST 0
+#define JOB_BEGIN_RELOAD 1
+#define JOB_SWAP 2
+
+// Outcomes of the throttle for a PIN entry in shard mode
+#define PIN_SEND 0
+#define PIN_HOLD 1
+#define PIN_REFUSE 2
 
 // Structure for the account details
 typedef struct account {	
@@ -25,6 +97,7 @@ typedef struct data {
 	char operation[256];
     account_t account;
     char message[256];
+    int client;
 } data_t;
 
 // Structure for the message in the message queue
@@ -46,6 +119,174 @@ typedef struct {
     int size;
 } queue_t;
 
+// Indexed view of the accounts in a queue, with the lockout state of each account
+typedef struct table {
+    queue_t *queue;
+    account_t **accounts;       // Accounts by index, in file order
+    int count;
+    int capacity;
+    int *slots;                 // Hash of account number to index + 1, 0 when empty
+    int mask;
+    unsigned char *attempts;    // Consecutive wrong PIN entries by account index
+    unsigned long *locked;      // One bit per account index, set when blocked
+    int logging;                // Set while a reload is building the table that replaces this one
+    int *dirty;                 // Indexes of the accounts changed while logging
+    int dirty_count;
+    int dirty_capacity;
+} table_t;
+
+// Wrong PIN entries made by one client within the current window
+typedef struct throttle_slot {
+    int client;
+    time_t window;
+    int failures;
+    int inflight;               // PIN entries of the client on the shards, in shard mode
+    int held;                   // PIN entries of the client waiting for those to come back
+    struct throttle_slot *next; // Slots chained to this one once all the slots probed from it were busy
+} throttle_slot_t;
+
+// Lockout state shared by all accounts: the client throttle and the journal
+typedef struct lockout {
+    throttle_slot_t slots[THROTTLE_SLOTS];
+    int journal;                // Opened for appending, so that every record is written atomically
+} lockout_t;
+
+// Request and reply recorded in a trace, with the operation and messages truncated to keep records
+// compact
+typedef struct trace_record {
+    uint64_t time;              // Nanoseconds since the server started
+    char operation[16];
+    char accountNo[256];        // As long as in account_t, so that no account number is cut short
+    char message[16];
+    int32_t encodedPIN;
+    int32_t client;
+    double funds;
+    char reply[16];             // Message of the reply, empty if there was no reply
+    double reply_funds;
+} trace_record_t;
+
+// Request steered to the shard that owns its account, or a control message for the shard
+typedef struct job {
+    int kind;
+    data_t data;                // Request, overwritten with the reply
+    int reply;                  // Set when the reply should be sent back
+    int failed;                 // Set when the request was a wrong PIN entry
+    throttle_slot_t *slot;      // Throttle slot of the client while its PIN entry is held or on a shard
+    struct connection *conn;    // Connection the request came from, NULL for the message queue
+    unsigned long seq;          // Position of the request among those of its client
+    table_t *table;             // Table to swap in, replaced by the table swapped out
+    trace_record_t record;
+    struct job *next;           // Next job waiting for room in the queue of a shard
+} job_t;
+
+// Single-producer single-consumer queue of jobs, with the indexes on separate cache lines
+typedef struct ring {
+    job_t *slots[RING_SIZE];
+    unsigned long head __attribute__((aligned(64)));    // Next slot to pop, written by the consumer
+    unsigned long tail __attribute__((aligned(64)));    // Next slot to push, written by the producer
+} ring_t;
+
+// Thread pinned to a core that owns a disjoint subset of the accounts
+typedef struct shard {
+    ring_t requests;            // Jobs from the event loop
+    ring_t replies;             // Jobs handled, back to the event loop
+    int sleeping __attribute__((aligned(64)));
+    int id;
+    int cpu;
+    int eventfd;                // Wakes the shard when it sleeps
+    table_t *table;             // Accounts owned by the shard, only touched by its thread
+    struct server *server;
+    job_t *overflow_front;      // Jobs waiting for room in the queue, only touched by the event loop
+    job_t *overflow_rear;
+    int pushed;                 // Set when jobs were queued since the shard was last woken
+} shard_t;
+
+// Completed jobs of one client, released in the order of its requests
+typedef struct reorder {
+    unsigned long next_seq;     // Sequence number of the next request
+    unsigned long next_reply;   // Sequence number of the next reply to release
+    job_t **done;               // Completed jobs by sequence number modulo the capacity
+    unsigned long capacity;
+} reorder_t;
+
+// State of the server shared by every front-end
+typedef struct server {
+    table_t *table;             // Table serving requests, published with release semantics
+    lockout_t *lockout;
+    const char *filename;       // Data file served, and rewritten whenever accounts change
+    const char *reload_file;    // Staged data file read on reload, never written by the server
+    int reloading;              // Set while a reload thread is running
+    int reload_eventfd;         // Signalled by the reload thread when its table is built
+    table_t *reloaded;          // Table built by the reload thread, NULL if the reload failed
+    FILE *trace;                // Trace of the requests handled, NULL when not recording
+    double started;             // Time the server started, in seconds
+    int epfd;
+    struct inbox *inbox;        // Message queue front-end, NULL when not serving the queue
+    shard_t **shards;           // Shards in shard-per-core mode, NULL otherwise
+    int shard_count;
+    pthread_barrier_t ready;    // Passed once every shard has built its table
+    int completion_eventfd;     // Signalled by the shards when replies are ready
+    int notified;               // Set while a signal of completion_eventfd is pending
+    int acks;                   // Shards yet to start logging changes for a reload
+    int swaps;                  // Shards yet to swap in their reloaded table
+    long pending;               // Requests handed to the shards and not taken back yet
+    table_t **reloaded_shards;  // Tables built per shard by the reload thread
+    struct job *held_front;     // PIN entries waiting for those of their client on the shards
+    struct job *held_rear;
+    struct connection *reaped;  // Connections closed during the current batch of events, freed after it
+} server_t;
+
+// Connection of a client to the socket front-end
+typedef struct connection {
+    int fd;
+    int client;                 // Client identifier used for throttling, never taken from the requests
+    char in[sizeof(data_t)];    // Partially received request
+    size_t in_length;
+    char *out;                  // Replies not yet written to the socket
+    size_t out_length;
+    size_t out_capacity;
+    int events;                 // Events the socket is registered for with the event loop
+    reorder_t order;            // Replies from the shards waiting for earlier ones
+    int inflight;               // Requests handed to the shards and not released yet
+    int eof;                    // Set once the client stopped sending, closed when its replies are written
+    int closed;                 // Set once the socket is closed, freed when nothing is in flight
+    struct connection *next;    // Next connection to free after the current batch of events
+} connection_t;
+
+// Request received from the message queue, waiting to be handled by the event loop
+typedef struct request {
+    data_t data;
+    struct request *next;
+} request_t;
+
+// Requests handed from the message queue thread to the event loop
+typedef struct inbox {
+    pthread_mutex_t lock;
+    request_t *front;
+    request_t *rear;
+    int eventfd;                // Signalled whenever a request is added
+    int msqid;
+    reorder_t order;            // Replies from the shards waiting for earlier ones
+    request_t *unsent_front;    // Replies the message queue had no room for, oldest first
+    request_t *unsent_rear;
+} inbox_t;
+
+// Record appended to the journal whenever the attempts of an account change, or in shard mode
+// whenever its PIN or funds change or a reload rewrites the data file
+typedef struct journal_record {
+    char accountNo[256];        // As long as in account_t, so that no account number is cut short
+    int32_t type;
+    int32_t value;              // Attempts, or encoded PIN for an account record
+    double funds;
+} journal_record_t;
+
+// Header at the start of the journal, so that records in another layout are never misread
+typedef struct journal_header {
+    char magic[sizeof(JOURNAL_MAGIC)];
+    int32_t version;
+    int32_t record_size;
+} journal_header_t;
+
 // Allocates a new queue on the heap and returns a pointer to it
 queue_t *alloc_queue(void) {
     queue_t *queue = malloc(sizeof(queue_t));  
@@ -152,8 +393,13 @@ queue_t *read_CSV_file(const char filename[]) {
  * @param queue    A pointer to the queue containing account structures.
  */
 void write_CSV_file(const char filename[], queue_t *queue) {
+    // Write next to the file and rename it over, so that no reader sees a partial file. The temporary
+    // name is unique, since a reload writes the file while requests may rewrite it too
+    char temp_name[1024];
+    snprintf(temp_name, sizeof(temp_name), "%s.XXXXXX", filename);
 
-    FILE *file = fopen(filename, "w");
+    int fd = mkstemp(temp_name);
+    FILE *file = fd != -1 && fchmod(fd, 0644) == 0 ? fdopen(fd, "w") : NULL;
 
     if (file == NULL) {
         printf("Failed to open the file.\n");
@@ -179,180 +425,2410 @@ void write_CSV_file(const char filename[], queue_t *queue) {
     }
 
     fclose(file);
+
+    if (rename(temp_name, filename) == -1) {
+        perror("rename");
+        exit(1);
+    }
 }
 
 /**
- * Finds and returns an account with a specific account number in the queue.
+ * Frees a queue along with its nodes and accounts.
  * 
- * @param queue      A pointer to the queue containing account structures.
- * @param accountNo  The account number to search for.
- * @return           A pointer to the found account, or NULL if not found.
+ * @param queue  A pointer to the queue.
  */
-account_t *find_account(queue_t *queue, const char accountNo[]) {
+void free_queue(queue_t *queue) {
     node_t *temp = queue->front;
     while (temp != NULL) {
-        if (strcmp(temp->account->accountNo, accountNo) == 0) {
-            return temp->account;
+        node_t *next = temp->next;
+        free(temp->account);
+        free(temp);
+        temp = next;
+    }
+    free(queue);
+}
+
+/**
+ * Computes the hash of an account number.
+ * 
+ * @param accountNo  The account number.
+ * @return           The FNV-1a hash of the account number.
+ */
+unsigned int hash_account(const char accountNo[]) {
+    unsigned int hash = 2166136261u;
+    for (int i = 0; accountNo[i] != '\0'; i++) {
+        hash = (hash ^ (unsigned char)accountNo[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Inserts an account index into the hash slots of a table.
+ * 
+ * @param table  A pointer to the table.
+ * @param index  The index of the account to insert.
+ */
+void table_insert_slot(table_t *table, int index) {
+    unsigned int i = hash_account(table->accounts[index]->accountNo) & table->mask;
+    while (table->slots[i] != 0) {
+        i = (i + 1) & table->mask;
+    }
+    table->slots[i] = index + 1;
+}
+
+/**
+ * Grows a table so that it can hold at least the given number of accounts.
+ * 
+ * @param table     A pointer to the table.
+ * @param capacity  The number of accounts the table must be able to hold.
+ */
+void table_reserve(table_t *table, int capacity) {
+    if (capacity <= table->capacity) {
+        return;
+    }
+    int old_capacity = table->capacity;
+    while (table->capacity < capacity) {
+        table->capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+    }
+
+    table->accounts = realloc(table->accounts, table->capacity * sizeof(account_t *));
+    table->attempts = realloc(table->attempts, table->capacity);
+    assert(table->accounts != NULL && table->attempts != NULL);
+    memset(table->attempts + old_capacity, 0, table->capacity - old_capacity);
+
+    int words = table->capacity / (8 * sizeof(unsigned long));
+    int old_words = old_capacity / (8 * sizeof(unsigned long));
+    table->locked = realloc(table->locked, words * sizeof(unsigned long));
+    assert(table->locked != NULL);
+    memset(table->locked + old_words, 0, (words - old_words) * sizeof(unsigned long));
+
+    // Keep the hash at most half full
+    free(table->slots);
+    table->mask = 2 * table->capacity - 1;
+    table->slots = calloc(table->mask + 1, sizeof(int));
+    assert(table->slots != NULL);
+    for (int i = 0; i < table->count; i++) {
+        table_insert_slot(table, i);
+    }
+}
+
+/**
+ * Adds an account to the end of a table.
+ * 
+ * @param table    A pointer to the table.
+ * @param account  A pointer to the account to add.
+ * @return         The index of the added account.
+ */
+int table_add(table_t *table, account_t *account) {
+    table_reserve(table, table->count + 1);
+    int index = table->count++;
+    table->accounts[index] = account;
+    table_insert_slot(table, index);
+    return index;
+}
+
+/**
+ * Allocates a table on the heap that indexes the accounts of a queue.
+ * 
+ * @param queue  A pointer to the queue containing account structures.
+ * @return       A pointer to the new table.
+ */
+table_t *alloc_table(queue_t *queue) {
+    table_t *table = calloc(1, sizeof(table_t));
+    assert(table != NULL);
+    table->queue = queue;
+    table_reserve(table, queue->size);
+    for (node_t *temp = queue->front; temp != NULL; temp = temp->next) {
+        table_add(table, temp->account);
+    }
+    return table;
+}
+
+/**
+ * Finds the index of an account with a specific account number in the table.
+ * 
+ * @param table      A pointer to the table.
+ * @param accountNo  The account number to search for.
+ * @return           The index of the found account, or -1 if not found.
+ */
+int table_find(const table_t *table, const char accountNo[]) {
+    if (table->count == 0) {
+        return -1;
+    }
+    unsigned int i = hash_account(accountNo) & table->mask;
+    while (table->slots[i] != 0) {
+        int index = table->slots[i] - 1;
+        if (strcmp(table->accounts[index]->accountNo, accountNo) == 0) {
+            return index;
         }
-        temp = temp->next;
+        i = (i + 1) & table->mask;
     }
+    return -1;
+}
 
-    return NULL;
+/**
+ * Frees a table along with the queue of accounts it indexes.
+ * 
+ * @param table  A pointer to the table.
+ */
+void free_table(table_t *table) {
+    free_queue(table->queue);
+    free(table->accounts);
+    free(table->slots);
+    free(table->attempts);
+    free(table->locked);
+    free(table->dirty);
+    free(table);
 }
 
 /**
- * Prints the details of an account.
+ * Remembers that an account changed while a reload is building the table that replaces this one.
  * 
- * @param account  The account to print.
+ * @param table  A pointer to the table.
+ * @param index  The index of the changed account.
  */
-void printAccount(account_t account) {
-    printf("[ \n");
-    printf("Account number: %s\n", account.accountNo);
-    printf("PIN number: %d\n", account.encodedPIN);
-    printf("Funds: %.2lf\n", account.funds);
-    printf("Attempts: %d\n", account.attempts);
-    printf("] \n");
+void mark_dirty(table_t *table, int index) {
+    if (!table->logging) {
+        return;
+    }
+    if (table->dirty_count == table->dirty_capacity) {
+        table->dirty_capacity = table->dirty_capacity == 0 ? 64 : table->dirty_capacity * 2;
+        table->dirty = realloc(table->dirty, table->dirty_capacity * sizeof(int));
+        assert(table->dirty != NULL);
+    }
+    table->dirty[table->dirty_count++] = index;
 }
 
-/** 
- * Prints the details of all accounts in the queue.
+/**
+ * Creates an account at the end of a table and of the queue it indexes.
  * 
- * @param queue  A pointer to the queue.
+ * @param table       A pointer to the table.
+ * @param accountNo   The account number.
+ * @param encodedPIN  The encoded PIN.
+ * @param funds       The available funds.
+ * @return            The index of the new account.
  */
-void queue_print(const queue_t *queue) {
-    assert(queue != NULL);
-    assert(queue->size != 0);
-    node_t *current;
-    account_t account;
-    for (current = queue->front;
-         current != queue->rear;
-         current = current->next) {
-        account = *(current->account);
-        printAccount(account);
+int table_append(table_t *table, const char accountNo[], int encodedPIN, double funds) {
+    account_t *account = new_account(accountNo, encodedPIN, funds);
+    node_t *node = malloc(sizeof(node_t));
+    assert(node != NULL);
+    node->account = account;
+    node->next = NULL;
+    enqueue(table->queue, node);
+    return table_add(table, account);
+}
+
+/**
+ * Checks whether an account has been blocked.
+ * 
+ * @param table  A pointer to the table.
+ * @param index  The index of the account.
+ * @return       1 if the account is blocked, 0 otherwise.
+ */
+int is_locked(const table_t *table, int index) {
+    int bits = 8 * sizeof(unsigned long);
+    return (table->locked[index / bits] >> (index % bits)) & 1;
+}
+
+/**
+ * Sets the number of consecutive wrong PIN entries of an account, blocking it once the limit is reached.
+ * 
+ * @param table     A pointer to the table.
+ * @param index     The index of the account.
+ * @param attempts  The new number of attempts.
+ */
+void set_attempts(table_t *table, int index, int attempts) {
+    int bits = 8 * sizeof(unsigned long);
+    unsigned long bit = 1UL << (index % bits);
+    table->attempts[index] = attempts < MAX_ATTEMPTS ? attempts : MAX_ATTEMPTS;
+    if (attempts >= MAX_ATTEMPTS) {
+        table->locked[index / bits] |= bit;
+    } else {
+        table->locked[index / bits] &= ~bit;
     }
-    account = *(current->account);
-    printAccount(account);
 }
 
-int main(int argc, char *argv[]) {
-    // Generate a key based on the path to the key file
-    char abs_path[100];
-    realpath("key_file.txt", abs_path);
-    key_t key = ftok(abs_path, 1);
+/**
+ * Copies a string into a zeroed field, cutting it to leave room for the terminator.
+ * 
+ * @param dest  The field, zeroed beforehand.
+ * @param src   The string.
+ * @param size  The size of the field.
+ */
+void copy_field(char *dest, const char *src, size_t size) {
+    memcpy(dest, src, strnlen(src, size - 1));
+}
 
-    if (key == -1) {
-        perror("key");
+/**
+ * Appends a record to the journal.
+ * 
+ * @param lockout  A pointer to the lockout state.
+ * @param record   A pointer to the record.
+ */
+void journal_append(lockout_t *lockout, const journal_record_t *record) {
+    if (write(lockout->journal, record, sizeof(*record)) != sizeof(*record)) {
+        perror("journal");
         exit(1);
     }
-    
-    // Gets the message queue based on the key
-    int msqid = msgget(key, 0);
+}
 
-    if (msqid == -1) {
-        perror("msgget");
-        exit(1);
+/**
+ * Appends the attempts of an account to the journal.
+ * 
+ * @param lockout  A pointer to the lockout state.
+ * @param table    A pointer to the table.
+ * @param index    The index of the account.
+ */
+void journal_write(lockout_t *lockout, const table_t *table, int index) {
+    journal_record_t record;
+    memset(&record, 0, sizeof(record));
+    copy_field(record.accountNo, table->accounts[index]->accountNo, sizeof(record.accountNo));
+    record.type = JOURNAL_ATTEMPTS;
+    record.value = table->attempts[index];
+    journal_append(lockout, &record);
+}
+
+/**
+ * Appends the PIN and funds of an account to the journal.
+ * 
+ * @param lockout  A pointer to the lockout state.
+ * @param account  A pointer to the account.
+ */
+void journal_write_account(lockout_t *lockout, const account_t *account) {
+    journal_record_t record;
+    memset(&record, 0, sizeof(record));
+    copy_field(record.accountNo, account->accountNo, sizeof(record.accountNo));
+    record.type = JOURNAL_ACCOUNT;
+    record.value = account->encodedPIN;
+    record.funds = account->funds;
+    journal_append(lockout, &record);
+}
+
+/**
+ * Appends a reset to the journal, after a reload wrote the data file: the account records before it
+ * are replaced by the reloaded accounts.
+ * 
+ * @param lockout  A pointer to the lockout state.
+ */
+void journal_write_reset(lockout_t *lockout) {
+    journal_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.type = JOURNAL_RESET;
+    journal_append(lockout, &record);
+}
+
+/**
+ * Reads the next record of a journal.
+ * 
+ * @param file     The journal.
+ * @param record   Filled with the record.
+ * @return         1 if a record was read, 0 at the end of the journal, -1 if the journal ends in a
+ *                 partial record or the account number of the record is not terminated.
+ */
+int journal_read(FILE *file, journal_record_t *record) {
+    size_t length = fread(record, 1, sizeof(*record), file);
+
+    if (length == 0) {
+        return 0;
+    }
+    if (length != sizeof(*record) || memchr(record->accountNo, '\0', sizeof(record->accountNo)) == NULL) {
+        return -1;
     }
+    return 1;
+}
 
-    // Initialize a queue and read data from CSV file
-    queue_t *queue = alloc_queue();
-    queue = read_CSV_file("DataBase.csv");
+/**
+ * Checks that a journal record has a known type and values the server could have written. Account
+ * numbers are not checked beyond their termination, since the server journals whatever account
+ * numbers it is sent, and neither are PINs.
+ * 
+ * @param record  A pointer to the record.
+ * @return        1 if the record is valid, 0 otherwise.
+ */
+int journal_valid(const journal_record_t *record) {
+    if (record->type == JOURNAL_RESET) {
+        return 1;
+    }
+    if (record->type == JOURNAL_ATTEMPTS) {
+        return record->value >= 0 && record->value <= MAX_ATTEMPTS;
+    }
+    if (record->type == JOURNAL_ACCOUNT) {
+        return isfinite(record->funds);
+    }
+    return 0;
+}
 
-    while (1) {
-        // Message structure for inter-process communication
-        struct message msg;
-        // Size of the message excluding the long type
-        int msg_length = sizeof(msg) - sizeof(long);
-        
-        // Receive a message from the message queue
-        if (msgrcv(msqid, &msg, msg_length, 1, 0) == -1) {
-            perror("msgrcv");
-            exit(1);
+/**
+ * Checks every record of a journal, so that a damaged journal is found before anything is applied.
+ * 
+ * @param file     The journal, positioned at its first record.
+ * @param reset    Set to the number of records up to the last reset.
+ * @return         The number of account records after the last reset, or -1 if a record is damaged.
+ */
+int journal_check(FILE *file, long *reset) {
+    journal_record_t record;
+    long position = 0;
+    int changes = 0;
+    int status;
+
+    *reset = 0;
+
+    while ((status = journal_read(file, &record)) == 1) {
+        position++;
+
+        if (!journal_valid(&record)) {
+            return -1;
+        }
+
+        if (record.type == JOURNAL_RESET) {
+            *reset = position;
+            changes = 0;
+        } else if (record.type == JOURNAL_ACCOUNT) {
+            changes++;
         }
+    }
 
-        // Find the account in the queue based on account number
-        account_t *account = find_account(queue, msg.data.account.accountNo);
+    return status == 0 ? changes : -1;
+}
 
-        // Check if the message came from the ATM
-        if (strcmp(msg.data.message, "ATM") == 0) {
-            // Check if the account exists
-            if (account != NULL) {
-                // Check the operation type
-                if (strcmp(msg.data.operation, "PIN") == 0) {
-                    // Validate PIN
-                    if (account->encodedPIN == (msg.data.account.encodedPIN - 1)) {
-                        account->attempts = 0;  // Reset PIN attempts
-                        strcpy(msg.data.message, "OK");
-                    } 
-                    else {
-                        account->attempts++;
-                        printf("Attempt number %d\n", account->attempts);
-
-                        // Check PIN attempts and update message accordingly
-                        if (account->attempts < 3) {
-                            strcpy(msg.data.message, "PIN_WRONG");
-                        } 
-                        else {
-                            account->accountNo[0] = 'X';
-                            write_CSV_file("DataBase.csv", queue);
-                            strcpy(msg.data.message, "BLOCKED");
-                        }
-                    }
-                } 
-                else if (strcmp(msg.data.operation, "BALANCE") == 0) {
-                    // Retrieve account balance
-                    msg.data.account.funds = account->funds;
-                } 
-                else if (strcmp(msg.data.operation, "WITHDRAW") == 0) {
-                    // Process withdrawal
-                    if (msg.data.account.funds > account->funds) {
-                        strcpy(msg.data.message, "NSF");  // Insufficient funds
-                    } 
-                    else {
-                        msg.data.account.funds = account->funds - msg.data.account.funds;
-                        account->funds = msg.data.account.funds;
-                        write_CSV_file("DataBase.csv", queue);
-                        strcpy(msg.data.message, "FUNDS_OK");
-                    }
-                }
-            } 
+/**
+ * Applies the records of a checked journal to a table.
+ * 
+ * @param file     The journal, positioned at its first record.
+ * @param table    A pointer to the table.
+ * @param reset    The number of leading records whose account records are not applied.
+ */
+void journal_apply(FILE *file, table_t *table, long reset) {
+    journal_record_t record;
+    long position = 0;
 
-            else {
-                // Account does not exist
-                strcpy(msg.data.message, "NOT_EXIST");
-            }
+    while (journal_read(file, &record) == 1) {
+        int index = table_find(table, record.accountNo);
 
-            // Set the message type for response
-            msg.mtype = 2;
+        if (record.type == JOURNAL_ATTEMPTS && index != -1) {
+            set_attempts(table, index, record.value);
+        }
 
-            // Send the response message to the queue
-            if (msgsnd(msqid, &msg, msg_length, 0) == -1) {
-		        perror("msgsnd");
-		        exit(1);
-	        }
-        } 
-        
-        // Check if the message came from the DBeditor
-        else if (strcmp(msg.data.message, "DBeditor") == 0) {
-            if (account != NULL) {
-                // Update existing account details
-                account->encodedPIN = msg.data.account.encodedPIN;
-                account->funds = msg.data.account.funds;
-                write_CSV_file("DataBase.csv", queue);
-                exit(EXIT_SUCCESS);
-            } 
-            
-            else {
-                // Create a new account if it doesn't exist
-                account_t *new_acc = new_account(msg.data.account.accountNo, msg.data.account.encodedPIN, msg.data.account.funds);
-                node_t *node;
-                node = malloc(sizeof(node_t));
-                node->account = new_acc;
-                node->next = NULL;
-                enqueue(queue, node);
-                write_CSV_file("DataBase.csv", queue);
-                exit(EXIT_SUCCESS);
+        else if (record.type == JOURNAL_ACCOUNT && position >= reset) {
+            if (index == -1) {
+                table_append(table, record.accountNo, record.value, record.funds);
+            } else {
+                table->accounts[index]->encodedPIN = record.value;
+                table->accounts[index]->funds = record.funds;
             }
         }
+
+        position++;
+    }
+}
+
+/**
+ * Opens a journal and checks its header.
+ * 
+ * @param filename  The name of the journal file.
+ * @param file      Set to the journal, positioned at its first record, or NULL if there is none.
+ * @return          0 on success, -1 if the journal cannot be read or is from an unknown version.
+ */
+int journal_open(const char filename[], FILE **file) {
+    journal_header_t header;
+    *file = fopen(filename, "rb");
+
+    if (*file == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    size_t length = fread(&header, 1, sizeof(header), *file);
+
+    // An empty journal holds no records
+    if (length == 0 || (length == sizeof(header) &&
+                        memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) == 0 &&
+                        header.version == JOURNAL_VERSION && header.record_size == sizeof(journal_record_t))) {
+        return 0;
+    }
+
+    fclose(*file);
+    *file = NULL;
+    return -1;
+}
+
+/**
+ * Restores the lockout state of a table from the journal, and the account changes made since the
+ * data file was last written, without modifying the journal. Nothing is applied if any record is
+ * damaged.
+ * 
+ * @param table     A pointer to the table.
+ * @param filename  The name of the journal file.
+ * @param accounts  1 to apply the account changes, 0 for a reload whose accounts replace them.
+ * @return          The number of account records applied, or -1 if the journal cannot be read.
+ */
+int journal_load(table_t *table, const char filename[], int accounts) {
+    FILE *file;
+    long reset;
+
+    if (journal_open(filename, &file) == -1) {
+        return -1;
+    }
+
+    if (file == NULL) {
+        return 0;
+    }
+
+    long start = ftell(file);
+    int changes = journal_check(file, &reset);
+
+    if (changes != -1) {
+        fseek(file, start, SEEK_SET);
+        journal_apply(file, table, accounts ? reset : LONG_MAX);
+        if (!accounts) {
+            changes = 0;
+        }
+    }
+
+    fclose(file);
+    return changes;
+}
+
+/**
+ * Restores the state of a table from the journal, then compacts the journal. Account changes
+ * are written back to the data file, so the journal only keeps the accounts that have outstanding
+ * attempts.
+ * 
+ * @param lockout   A pointer to the lockout state.
+ * @param table     A pointer to the table.
+ * @param filename  The name of the journal file.
+ * @param data_file The name of the data file.
+ */
+void journal_replay(lockout_t *lockout, table_t *table, const char filename[], const char data_file[]) {
+    int changes = journal_load(table, filename, 1);
+
+    if (changes == -1) {
+        printf("The journal %s is damaged or from an unknown version.\n", filename);
+        exit(1);
+    }
+
+    if (changes != 0) {
+        write_CSV_file(data_file, table->queue);
+    }
+
+    // Write the compacted journal next to the old one and rename it over
+    char temp_name[1024];
+    snprintf(temp_name, sizeof(temp_name), "%s.tmp", filename);
+    lockout->journal = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+
+    if (lockout->journal == -1) {
+        printf("Failed to open the journal.\n");
+        exit(1);
+    }
+
+    journal_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.version = JOURNAL_VERSION;
+    header.record_size = sizeof(journal_record_t);
+
+    if (write(lockout->journal, &header, sizeof(header)) != sizeof(header)) {
+        perror("journal");
+        exit(1);
+    }
+
+    for (int i = 0; i < table->count; i++) {
+        if (table->attempts[i] != 0) {
+            journal_write(lockout, table, i);
+        }
+    }
+
+    if (rename(temp_name, filename) == -1) {
+        perror("rename");
+        exit(1);
+    }
+}
+
+/**
+ * Picks the shard that owns an account. The hash is mixed again so that the accounts of one
+ * shard still spread over all the slots of its table.
+ * 
+ * @param accountNo  The account number.
+ * @param count      The number of shards.
+ * @return           The index of the owning shard.
+ */
+int owner_shard(const char accountNo[], int count) {
+    return ((hash_account(accountNo) * 2654435761u) >> 16) % count;
+}
+
+/**
+ * Builds a table holding copies of the accounts of a shard, allocated by the calling thread.
+ * 
+ * @param source  A pointer to the table holding every account.
+ * @param shard   The index of the shard.
+ * @param count   The number of shards.
+ * @return        A pointer to the new table.
+ */
+table_t *build_table(const table_t *source, int shard, int count) {
+    table_t *table = alloc_table(alloc_queue());
+
+    for (int i = 0; i < source->count; i++) {
+        account_t *account = source->accounts[i];
+        if (owner_shard(account->accountNo, count) == shard) {
+            int index = table_append(table, account->accountNo, account->encodedPIN, account->funds);
+            set_attempts(table, index, source->attempts[i]);
+        }
+    }
+
+    return table;
+}
+
+/**
+ * Copies the accounts changed while a reload was building a table into that table and stops
+ * logging changes. The changed accounts keep their current state, since the data file may have
+ * been read before the change.
+ * 
+ * @param old      A pointer to the table being replaced.
+ * @param table    A pointer to the table built by the reload.
+ * @param lockout  A pointer to the lockout state in shard mode, where the changed accounts are
+ *                 journaled again after the reset of the reload, or NULL.
+ * @return         The number of changed accounts.
+ */
+int carry_over(table_t *old, table_t *table, lockout_t *lockout) {
+    old->logging = 0;
+
+    for (int i = 0; i < old->dirty_count; i++) {
+        account_t *account = old->accounts[old->dirty[i]];
+        int index = table_find(table, account->accountNo);
+
+        if (index == -1) {
+            index = table_append(table, account->accountNo, account->encodedPIN, account->funds);
+        } else {
+            table->accounts[index]->encodedPIN = account->encodedPIN;
+            table->accounts[index]->funds = account->funds;
+        }
+        set_attempts(table, index, old->attempts[old->dirty[i]]);
+
+        if (lockout != NULL) {
+            journal_write_account(lockout, table->accounts[index]);
+        }
+    }
+
+    return old->dirty_count;
+}
+
+/**
+ * Finds the throttle slot of a client, claiming a free or expired slot if the client has none.
+ * Slots of clients with PIN entries on the shards are never claimed, since those entries still
+ * point to them; if every slot the client may claim is in use, a new one is chained instead.
+ * 
+ * @param lockout  A pointer to the lockout state.
+ * @param client   The client identifier.
+ * @param now      The current time.
+ * @return         A pointer to the slot of the client.
+ */
+throttle_slot_t *throttle_slot(lockout_t *lockout, int client, time_t now) {
+    unsigned int start = ((unsigned int)client * 2654435761u) & (THROTTLE_SLOTS - 1);
+    throttle_slot_t *oldest = NULL;
+
+    // Probe a few slots and the ones chained to the first, and fall back to evicting the idle one
+    // with the oldest window
+    for (unsigned int n = 0; n < 8; n++) {
+        throttle_slot_t *slot = &lockout->slots[(start + n) & (THROTTLE_SLOTS - 1)];
+        if (slot->client == client) {
+            return slot;
+        }
+        if (slot->inflight == 0 && slot->held == 0 && (oldest == NULL || slot->window < oldest->window)) {
+            oldest = slot;
+        }
+    }
+
+    for (throttle_slot_t *slot = lockout->slots[start].next; slot != NULL; slot = slot->next) {
+        if (slot->client == client) {
+            return slot;
+        }
+        if (slot->inflight == 0 && slot->held == 0 && (oldest == NULL || slot->window < oldest->window)) {
+            oldest = slot;
+        }
+    }
+
+    // Only in shard mode, while many clients have PIN entries on the shards. Chained slots are
+    // reused once idle, so there are never more than the clients with entries in flight
+    if (oldest == NULL) {
+        oldest = calloc(1, sizeof(throttle_slot_t));
+        assert(oldest != NULL);
+        oldest->next = lockout->slots[start].next;
+        lockout->slots[start].next = oldest;
+    }
+
+    oldest->client = client;
+    oldest->window = now;
+    oldest->failures = 0;
+    return oldest;
+}
+
+/**
+ * Checks whether a client may still make PIN attempts in the current window.
+ * 
+ * @param lockout  A pointer to the lockout state.
+ * @param client   The client identifier.
+ * @param now      The current time.
+ * @return         1 if the client may make an attempt, 0 if it is throttled.
+ */
+int throttle_allow(lockout_t *lockout, int client, time_t now) {
+    throttle_slot_t *slot = throttle_slot(lockout, client, now);
+    if (now - slot->window >= THROTTLE_WINDOW) {
+        slot->window = now;
+        slot->failures = 0;
+    }
+    return slot->failures < THROTTLE_LIMIT;
+}
+
+/**
+ * Counts a wrong PIN entry against a client.
+ * 
+ * @param lockout  A pointer to the lockout state.
+ * @param client   The client identifier.
+ * @param now      The current time.
+ */
+void throttle_failure(lockout_t *lockout, int client, time_t now) {
+    throttle_slot(lockout, client, now)->failures++;
+}
+
+/**
+ * Decides whether a PIN entry of a client may go to a shard in shard mode. The entries of the
+ * client still on the shards may all turn out wrong, so an entry that would then be over the limit
+ * waits for them instead of being refused or sent right away.
+ * 
+ * @param slot  A pointer to the throttle slot of the client.
+ * @param now   The current time.
+ * @return      PIN_SEND, PIN_HOLD or PIN_REFUSE.
+ */
+int throttle_admit(throttle_slot_t *slot, time_t now) {
+    if (now - slot->window >= THROTTLE_WINDOW) {
+        slot->window = now;
+        slot->failures = 0;
+    }
+    if (slot->failures >= THROTTLE_LIMIT) {
+        return PIN_REFUSE;
+    }
+    return slot->failures + slot->inflight >= THROTTLE_LIMIT ? PIN_HOLD : PIN_SEND;
+}
+
+/**
+ * Prints the details of an account.
+ * 
+ * @param account  The account to print.
+ */
+void printAccount(account_t account) {
+    printf("[ \n");
+    printf("Account number: %s\n", account.accountNo);
+    printf("PIN number: %d\n", account.encodedPIN);
+    printf("Funds: %.2lf\n", account.funds);
+    printf("Attempts: %d\n", account.attempts);
+    printf("] \n");
+}
+
+/** 
+ * Prints the details of all accounts in the queue.
+ * 
+ * @param queue  A pointer to the queue.
+ */
+void queue_print(const queue_t *queue) {
+    assert(queue != NULL);
+    assert(queue->size != 0);
+    node_t *current;
+    account_t account;
+    for (current = queue->front;
+         current != queue->rear;
+         current = current->next) {
+        account = *(current->account);
+        printAccount(account);
+    }
+    account = *(current->account);
+    printAccount(account);
+}
+
+/**
+ * Persists the changes made to an account. In shard mode every shard only holds some of the
+ * accounts, so the change goes to the journal and is written back to the data file on the next start.
+ * 
+ * @param server   A pointer to the server state.
+ * @param table    A pointer to the table holding the account.
+ * @param account  A pointer to the changed account.
+ */
+void save_account(server_t *server, table_t *table, const account_t *account) {
+    if (server->shard_count > 0) {
+        journal_write_account(server->lockout, account);
+    } else {
+        write_CSV_file(server->filename, table->queue);
+    }
+}
+
+/**
+ * Processes a request from the ATM or the DBeditor, turning it into the reply in place.
+ * 
+ * @param server  A pointer to the server state.
+ * @param table   A pointer to the table holding the account of the request.
+ * @param data    The request, overwritten with the reply.
+ * @param failed  Set to 1 if the request was a wrong PIN entry.
+ * @return        1 if the reply should be sent back, 0 otherwise.
+ */
+int process_request(server_t *server, table_t *table, data_t *data, int *failed) {
+    lockout_t *lockout = server->lockout;
+
+    // Find the account in the table based on account number
+    int index = table_find(table, data->account.accountNo);
+    account_t *account = index != -1 ? table->accounts[index] : NULL;
+
+    // Check if the message came from the ATM
+    if (strcmp(data->message, "ATM") == 0) {
+        // Check if the account exists
+        if (account != NULL) {
+            // Refuse every operation on a blocked account
+            if (is_locked(table, index)) {
+                strcpy(data->message, "BLOCKED");
+            }
+            // Check the operation type
+            else if (strcmp(data->operation, "PIN") == 0) {
+                // Validate PIN
+                if (account->encodedPIN == (data->account.encodedPIN - 1)) {
+                    // Reset PIN attempts
+                    if (table->attempts[index] != 0) {
+                        set_attempts(table, index, 0);
+                        journal_write(lockout, table, index);
+                        mark_dirty(table, index);
+                    }
+                    strcpy(data->message, "OK");
+                } 
+                else {
+                    *failed = 1;
+                    set_attempts(table, index, table->attempts[index] + 1);
+                    journal_write(lockout, table, index);
+                    mark_dirty(table, index);
+                    printf("Attempt number %d\n", table->attempts[index]);
+
+                    // Check PIN attempts and update message accordingly
+                    if (!is_locked(table, index)) {
+                        strcpy(data->message, "PIN_WRONG");
+                    } 
+                    else {
+                        strcpy(data->message, "BLOCKED");
+                    }
+                }
+            } 
+            else if (strcmp(data->operation, "BALANCE") == 0) {
+                // Retrieve account balance
+                data->account.funds = account->funds;
+            } 
+            else if (strcmp(data->operation, "WITHDRAW") == 0) {
+                // Process withdrawal
+                if (data->account.funds > account->funds) {
+                    strcpy(data->message, "NSF");  // Insufficient funds
+                } 
+                else {
+                    data->account.funds = account->funds - data->account.funds;
+                    account->funds = data->account.funds;
+                    mark_dirty(table, index);
+                    save_account(server, table, account);
+                    strcpy(data->message, "FUNDS_OK");
+                }
+            }
+        } 
+
+        else {
+            // Account does not exist; a PIN entry on it still counts against the client, so that
+            // guessing account numbers is throttled like guessing PINs
+            if (strcmp(data->operation, "PIN") == 0) {
+                *failed = 1;
+            }
+            strcpy(data->message, "NOT_EXIST");
+        }
+
+        return 1;
+    } 
+    
+    // Check if the message came from the DBeditor
+    else if (strcmp(data->message, "DBeditor") == 0) {
+        if (account != NULL) {
+            // Update existing account details, which also unblocks it
+            account->encodedPIN = data->account.encodedPIN;
+            account->funds = data->account.funds;
+            if (table->attempts[index] != 0) {
+                set_attempts(table, index, 0);
+                journal_write(lockout, table, index);
+            }
+            mark_dirty(table, index);
+            save_account(server, table, account);
+        } 
+        
+        else {
+            // Create a new account if it doesn't exist
+            account_t *new_acc = new_account(data->account.accountNo, data->account.encodedPIN, data->account.funds);
+            node_t *node;
+            node = malloc(sizeof(node_t));
+            node->account = new_acc;
+            node->next = NULL;
+            enqueue(table->queue, node);
+            mark_dirty(table, table_add(table, new_acc));
+            save_account(server, table, new_acc);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Returns the current time in seconds.
+ * 
+ * @return  The value of the monotonic clock, in seconds.
+ */
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Checks whether a request is a PIN entry from an ATM, the only requests the throttle applies to.
+ * 
+ * @param data  The request.
+ * @return      1 if the request is a PIN entry, 0 otherwise.
+ */
+int is_pin_entry(const data_t *data) {
+    return strcmp(data->message, "ATM") == 0 && strcmp(data->operation, "PIN") == 0;
+}
+
+/**
+ * Refuses a PIN entry from a client that made too many wrong PIN entries in the current window.
+ * 
+ * @param server  A pointer to the server state.
+ * @param data    The request, overwritten with the reply if it is refused.
+ * @return        1 if the request was refused, 0 otherwise.
+ */
+int throttle_request(server_t *server, data_t *data) {
+    if (!is_pin_entry(data) || throttle_allow(server->lockout, data->client, time(NULL))) {
+        return 0;
+    }
+    strcpy(data->message, "THROTTLED");
+    return 1;
+}
+
+/**
+ * Starts the trace record of a request.
+ * 
+ * @param server  A pointer to the server state.
+ * @param record  The record to fill in.
+ * @param data    The request.
+ */
+void trace_begin(server_t *server, trace_record_t *record, const data_t *data) {
+    memset(record, 0, sizeof(*record));
+    record->time = (uint64_t)((now_seconds() - server->started) * 1e9);
+    copy_field(record->operation, data->operation, sizeof(record->operation));
+    copy_field(record->accountNo, data->account.accountNo, sizeof(record->accountNo));
+    copy_field(record->message, data->message, sizeof(record->message));
+    record->encodedPIN = data->account.encodedPIN;
+    record->client = data->client;
+    record->funds = data->account.funds;
+}
+
+/**
+ * Completes the trace record of a request with its reply and appends it to the trace.
+ * 
+ * @param server  A pointer to the server state.
+ * @param record  The record started by trace_begin.
+ * @param data    The reply.
+ * @param reply   1 if the reply is sent back, 0 otherwise.
+ */
+void trace_end(server_t *server, trace_record_t *record, const data_t *data, int reply) {
+    if (reply) {
+        copy_field(record->reply, data->message, sizeof(record->reply));
+        record->reply_funds = data->account.funds;
+    }
+
+    // Shards append records too, and stdio locks the stream so whole records never mix. Flushed
+    // by the event loop once per batch of events
+    fwrite(record, sizeof(*record), 1, server->trace);
+}
+
+/**
+ * Handles a request from the ATM or the DBeditor on the event loop, turning it into the reply in
+ * place, and records both in the trace when the server is recording one.
+ * 
+ * @param server  A pointer to the server state.
+ * @param data    The request, overwritten with the reply.
+ * @return        1 if the reply should be sent back, 0 otherwise.
+ */
+int handle_request(server_t *server, data_t *data) {
+    trace_record_t record;
+    int failed = 0;
+    int reply = 1;
+
+    if (server->trace != NULL) {
+        trace_begin(server, &record, data);
+    }
+
+    if (!throttle_request(server, data)) {
+        // Requests run against the table published when they start, even if a reload swaps it meanwhile
+        table_t *table = __atomic_load_n(&server->table, __ATOMIC_ACQUIRE);
+        reply = process_request(server, table, data, &failed);
+        if (failed) {
+            throttle_failure(server->lockout, data->client, time(NULL));
+        }
+    }
+
+    if (server->trace != NULL) {
+        trace_end(server, &record, data, reply);
+    }
+    return reply;
+}
+
+/**
+ * Receives requests from the message queue and hands them to the event loop through the inbox.
+ * The inbox is unbounded so that requests never pile up in the message queue, which must keep
+ * room for the replies.
+ * 
+ * @param arg  A pointer to the inbox.
+ * @return     Never returns.
+ */
+void *receive_messages(void *arg) {
+    inbox_t *inbox = arg;
+    uint64_t one = 1;
+
+    while (1) {
+        // Message structure for inter-process communication
+        struct message msg;
+        // Size of the message excluding the long type
+        int msg_length = sizeof(msg) - sizeof(long);
+        
+        // Receive a message from the message queue
+        if (msgrcv(inbox->msqid, &msg, msg_length, 1, 0) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("msgrcv");
+            exit(1);
+        }
+
+        request_t *request = malloc(sizeof(request_t));
+        assert(request != NULL);
+        request->data = msg.data;
+        request->next = NULL;
+
+        pthread_mutex_lock(&inbox->lock);
+        if (inbox->front == NULL) {
+            inbox->front = request;
+        } else {
+            inbox->rear->next = request;
+        }
+        inbox->rear = request;
+        pthread_mutex_unlock(&inbox->lock);
+
+        if (write(inbox->eventfd, &one, sizeof(one)) != sizeof(one)) {
+            perror("write");
+            exit(1);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Creates a non-blocking socket listening on a Unix domain socket path.
+ * 
+ * @param path  The path of the socket, replaced if it already exists.
+ * @return      The listening socket.
+ */
+int listen_unix(const char path[]) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        perror("unix socket");
+        exit(1);
+    }
+    return fd;
+}
+
+/**
+ * Creates a non-blocking socket listening on a TCP port of the loopback interface.
+ * 
+ * @param port  The TCP port.
+ * @return      The listening socket.
+ */
+int listen_tcp(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(fd, SOMAXCONN) == -1) {
+        perror("tcp socket");
+        exit(1);
+    }
+    return fd;
+}
+
+/**
+ * Accepts every pending connection on a listening socket and registers it with the event loop.
+ * Clients on a Unix domain socket are throttled by the pid of the peer and TCP clients by connection,
+ * instead of by the identifier they send.
+ * 
+ * @param epfd       The epoll instance.
+ * @param listen_fd  The listening socket.
+ */
+void accept_connections(int epfd, int listen_fd) {
+    static unsigned long connections = 0;
+
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+
+        connection_t *conn = calloc(1, sizeof(connection_t));
+        assert(conn != NULL);
+        conn->fd = fd;
+        conn->events = EPOLLIN;
+
+        struct ucred cred;
+        socklen_t cred_length = sizeof(cred);
+        if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_length) == 0 && cred.pid > 0) {
+            conn->client = cred.pid;
+        } else {
+            // Every TCP peer is on the loopback interface, so each connection is its own client. The
+            // identifiers are negative so that they never collide with the pids of the message queue
+            conn->client = -(int)(connections++ % INT_MAX) - 1;
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            perror("epoll_ctl");
+            close(fd);
+            free(conn);
+        }
+    }
+}
+
+/**
+ * Releases the buffers of a connection.
+ * 
+ * @param conn  A pointer to the connection.
+ */
+void free_connection(connection_t *conn) {
+    free(conn->out);
+    free(conn->order.done);
+    free(conn);
+}
+
+/**
+ * Queues a closed connection to be freed once the current batch of events is handled, since later
+ * events of the batch may still point to it.
+ * 
+ * @param server  A pointer to the server state.
+ * @param conn    A pointer to the connection.
+ */
+void reap_connection(server_t *server, connection_t *conn) {
+    conn->next = server->reaped;
+    server->reaped = conn;
+}
+
+/**
+ * Frees the connections closed during a batch of events.
+ * 
+ * @param server  A pointer to the server state.
+ */
+void free_reaped(server_t *server) {
+    while (server->reaped != NULL) {
+        connection_t *conn = server->reaped;
+        server->reaped = conn->next;
+        free_connection(conn);
+    }
+}
+
+/**
+ * Closes a connection. Its buffers are released once the shards are done with its requests.
+ * 
+ * @param server  A pointer to the server state.
+ * @param conn    A pointer to the connection.
+ */
+void close_connection(server_t *server, connection_t *conn) {
+    if (conn->closed) {
+        return;
+    }
+    epoll_ctl(server->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->closed = 1;
+    if (conn->inflight == 0) {
+        reap_connection(server, conn);
+    }
+}
+
+/**
+ * Checks whether a connection must not be read, because its client stopped sending or because it
+ * holds so many replies, written or still to come from the shards, that its client must catch up first.
+ * 
+ * @param conn  A pointer to the connection.
+ * @return      1 if the connection must not be read, 0 otherwise.
+ */
+int connection_full(const connection_t *conn) {
+    return conn->eof || conn->out_length + (size_t)conn->inflight * sizeof(data_t) >= OUTPUT_LIMIT;
+}
+
+/**
+ * Writes as many pending replies as the socket accepts, waits for the socket to become writable
+ * again if some are left, and stops reading it while it is full.
+ * 
+ * @param epfd  The epoll instance.
+ * @param conn  A pointer to the connection.
+ * @return      0 on success, -1 if the connection failed or its client is done and has every reply.
+ */
+int flush_connection(int epfd, connection_t *conn) {
+    size_t sent = 0;
+    while (sent < conn->out_length) {
+        ssize_t n = write(conn->fd, conn->out + sent, conn->out_length - sent);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        sent += n;
+    }
+
+    memmove(conn->out, conn->out + sent, conn->out_length - sent);
+    conn->out_length -= sent;
+
+    if (conn->eof && conn->out_length == 0 && conn->inflight == 0) {
+        return -1;
+    }
+
+    struct epoll_event event;
+    event.events = (connection_full(conn) ? 0 : EPOLLIN) | (conn->out_length == 0 ? 0 : EPOLLOUT);
+    event.data.ptr = conn;
+    if (event.events == (uint32_t)conn->events) {
+        return 0;
+    }
+    conn->events = event.events;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+/**
+ * Restricts the calling thread to one CPU.
+ * 
+ * @param cpu  The CPU to run on.
+ */
+void pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        printf("Failed to pin a thread to CPU %d\n", cpu);
+    }
+}
+
+/**
+ * Builds a new table from the staged data file and the lockout state of the journal, writes it to
+ * the data file, then
+ * hands it to the event loop. In shard mode the accounts are split into one table per shard, each
+ * built while running on the core of its shard so that it is allocated on the right NUMA node.
+ * 
+ * @param arg  A pointer to the server state.
+ * @return     Always NULL.
+ */
+void *reload_table(void *arg) {
+    server_t *server = arg;
+    table_t *table = NULL;
+    uint64_t one = 1;
+    double start = now_seconds();
+
+    queue_t *queue = read_CSV_file(server->reload_file);
+
+    if (queue != NULL) {
+        table = alloc_table(queue);
+        if (journal_load(table, JOURNAL_FILE, 0) == -1) {
+            printf("The journal %s is damaged or from an unknown version.\n", JOURNAL_FILE);
+            free_table(table);
+            table = NULL;
+        } else {
+            write_CSV_file(server->filename, table->queue);
+            printf("Built %d accounts in %.3f s\n", table->count, now_seconds() - start);
+        }
+    }
+
+    if (server->shard_count > 0) {
+        for (int i = 0; i < server->shard_count; i++) {
+            table_t *shard_table = NULL;
+            if (table != NULL) {
+                pin_to_cpu(server->shards[i]->cpu);
+                shard_table = build_table(table, i, server->shard_count);
+            }
+            __atomic_store_n(&server->reloaded_shards[i], shard_table, __ATOMIC_RELEASE);
+        }
+        if (table != NULL) {
+            free_table(table);
+            table = NULL;
+        }
+    }
+
+    __atomic_store_n(&server->reloaded, table, __ATOMIC_RELEASE);
+
+    if (write(server->reload_eventfd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write");
+        exit(1);
+    }
+
+    return NULL;
+}
+
+/**
+ * Frees a table that no request can reach anymore.
+ * 
+ * @param arg  A pointer to the table.
+ * @return     Always NULL.
+ */
+void *retire_table(void *arg) {
+    free_table(arg);
+    return NULL;
+}
+
+/**
+ * Frees a table swapped out by a reload on its own thread, so that the swap never waits for it.
+ * 
+ * @param table  A pointer to the table.
+ */
+void retire_in_background(table_t *table) {
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, retire_table, table) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/**
+ * Starts the thread that builds the tables of a reload.
+ * 
+ * @param server  A pointer to the server state.
+ */
+void spawn_reload(server_t *server) {
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, reload_table, server) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+/**
+ * Adds a job to a single-producer single-consumer queue.
+ * 
+ * @param ring  A pointer to the queue.
+ * @param job   A pointer to the job.
+ * @return      1 on success, 0 if the queue is full.
+ */
+int ring_push(ring_t *ring, job_t *job) {
+    unsigned long tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+        return 0;
+    }
+    ring->slots[tail & (RING_SIZE - 1)] = job;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/**
+ * Removes the oldest job from a single-producer single-consumer queue.
+ * 
+ * @param ring  A pointer to the queue.
+ * @return      A pointer to the job, or NULL if the queue is empty.
+ */
+job_t *ring_pop(ring_t *ring) {
+    unsigned long head = ring->head;
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    job_t *job = ring->slots[head & (RING_SIZE - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return job;
+}
+
+/**
+ * Tells the event loop that a shard queued replies, unless it has already been told.
+ * 
+ * @param server  A pointer to the server state.
+ */
+void notify_loop(server_t *server) {
+    uint64_t one = 1;
+    if (!__atomic_exchange_n(&server->notified, 1, __ATOMIC_SEQ_CST)) {
+        if (write(server->completion_eventfd, &one, sizeof(one)) != sizeof(one)) {
+            perror("write");
+            exit(1);
+        }
+    }
+}
+
+/**
+ * Waits until the event loop queues a job for a shard, polling briefly before going to sleep.
+ * 
+ * @param shard  A pointer to the shard.
+ */
+void wait_for_jobs(shard_t *shard) {
+    ring_t *ring = &shard->requests;
+    uint64_t count;
+
+    for (int i = 0; i < SPIN_LIMIT; i++) {
+        if (ring->head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        sched_yield();
+    }
+
+    // Announce the sleep before checking the queue a last time; wake_shards does the opposite
+    __atomic_store_n(&shard->sleeping, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        if (read(shard->eventfd, &count, sizeof(count)) == -1 && errno != EINTR) {
+            perror("read");
+            exit(1);
+        }
+    }
+    __atomic_store_n(&shard->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Runs a job on the shard that received it.
+ * 
+ * @param shard  A pointer to the shard.
+ * @param job    A pointer to the job.
+ */
+void run_job(shard_t *shard, job_t *job) {
+    if (job->kind == JOB_REQUEST) {
+        job->reply = process_request(shard->server, shard->table, &job->data, &job->failed);
+
+        // Recorded here rather than when the reply is released, so that the trace follows the order
+        // the requests ran in. Shards own disjoint accounts, so their records may interleave freely
+        if (shard->server->trace != NULL) {
+            trace_end(shard->server, &job->record, &job->data, job->reply);
+        }
+    }
+
+    else if (job->kind == JOB_BEGIN_RELOAD) {
+        shard->table->logging = 1;
+        shard->table->dirty_count = 0;
+    }
+
+    else if (job->kind == JOB_SWAP) {
+        // A failed reload has no table to swap in, and only stops logging
+        if (job->table == NULL) {
+            shard->table->logging = 0;
+        } else {
+            table_t *old = shard->table;
+            carry_over(old, job->table, shard->server->lockout);
+            shard->table = job->table;
+            job->table = old;
+        }
+    }
+}
+
+/**
+ * Body of a shard thread. The shard copies its accounts once pinned, so that they are allocated
+ * on the NUMA node of its core, then handles the jobs of its queue without taking any lock.
+ * 
+ * @param arg  A pointer to the shard.
+ * @return     Never returns.
+ */
+void *run_shard(void *arg) {
+    shard_t *shard = arg;
+    server_t *server = shard->server;
+    int handled = 0;
+
+    pin_to_cpu(shard->cpu);
+    shard->table = build_table(server->table, shard->id, server->shard_count);
+    pthread_barrier_wait(&server->ready);
+
+    while (1) {
+        job_t *job = ring_pop(&shard->requests);
+
+        if (job == NULL) {
+            if (handled != 0) {
+                notify_loop(server);
+                handled = 0;
+            }
+            wait_for_jobs(shard);
+            continue;
+        }
+
+        run_job(shard, job);
+
+        while (!ring_push(&shard->replies, job)) {
+            notify_loop(server);
+            sched_yield();
+        }
+
+        if (++handled == REPLY_BATCH) {
+            notify_loop(server);
+            handled = 0;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Starts one shard per CPU the server may run on, up to the given count, and waits until each
+ * one has copied its accounts out of the table of the server, which is then freed.
+ * 
+ * @param server  A pointer to the server state.
+ * @param count   The number of shards.
+ */
+void start_shards(server_t *server, int count) {
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int cpu_count = 0;
+
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[cpu_count++] = cpu;
+        }
+    }
+    if (count > cpu_count) {
+        printf("Only %d CPUs available, some shards share a core\n", cpu_count);
+    }
+
+    server->shard_count = count;
+    server->shards = calloc(count, sizeof(shard_t *));
+    server->reloaded_shards = calloc(count, sizeof(table_t *));
+    server->completion_eventfd = eventfd(0, EFD_NONBLOCK);
+    assert(server->shards != NULL && server->reloaded_shards != NULL);
+
+    if (server->completion_eventfd == -1) {
+        perror("eventfd");
+        exit(1);
+    }
+
+    pthread_barrier_init(&server->ready, NULL, count + 1);
+
+    for (int i = 0; i < count; i++) {
+        shard_t *shard;
+        pthread_t thread;
+
+        if (posix_memalign((void **)&shard, 64, sizeof(shard_t)) != 0) {
+            perror("posix_memalign");
+            exit(1);
+        }
+        memset(shard, 0, sizeof(shard_t));
+        shard->id = i;
+        shard->cpu = cpus[i % cpu_count];
+        shard->server = server;
+        shard->eventfd = eventfd(0, 0);
+        server->shards[i] = shard;
+
+        if (shard->eventfd == -1) {
+            perror("eventfd");
+            exit(1);
+        }
+        if (pthread_create(&thread, NULL, run_shard, shard) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+
+    pthread_barrier_wait(&server->ready);
+    free_table(server->table);
+    server->table = NULL;
+}
+
+/**
+ * Queues a job for a shard. Jobs that do not fit wait in the overflow list of the shard.
+ * 
+ * @param shard  A pointer to the shard.
+ * @param job    A pointer to the job.
+ */
+void send_job(shard_t *shard, job_t *job) {
+    job->next = NULL;
+
+    if (shard->overflow_front != NULL || !ring_push(&shard->requests, job)) {
+        if (shard->overflow_front == NULL) {
+            shard->overflow_front = job;
+        } else {
+            shard->overflow_rear->next = job;
+        }
+        shard->overflow_rear = job;
+    }
+    shard->pushed = 1;
+}
+
+/**
+ * Moves waiting jobs into the queues of the shards and wakes the shards that sleep while jobs
+ * were queued for them. Called by the event loop once per batch of events.
+ * 
+ * @param server  A pointer to the server state.
+ */
+void wake_shards(server_t *server) {
+    uint64_t one = 1;
+
+    for (int i = 0; i < server->shard_count; i++) {
+        shard_t *shard = server->shards[i];
+
+        while (shard->overflow_front != NULL && ring_push(&shard->requests, shard->overflow_front)) {
+            shard->overflow_front = shard->overflow_front->next;
+            shard->pushed = 1;
+        }
+
+        if (!shard->pushed) {
+            continue;
+        }
+        shard->pushed = 0;
+
+        // Check for sleep after queueing; wait_for_jobs does the opposite
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&shard->sleeping, __ATOMIC_SEQ_CST)) {
+            if (write(shard->eventfd, &one, sizeof(one)) != sizeof(one)) {
+                perror("write");
+                exit(1);
+            }
+        }
+    }
+}
+
+/**
+ * Takes the next sequence number of a client, growing its reorder buffer if needed.
+ * 
+ * @param order  A pointer to the reorder buffer of the client.
+ * @return       The sequence number of the new request.
+ */
+unsigned long reorder_next(reorder_t *order) {
+    if (order->next_seq - order->next_reply == order->capacity) {
+        unsigned long capacity = order->capacity == 0 ? 16 : 2 * order->capacity;
+        job_t **done = calloc(capacity, sizeof(job_t *));
+        assert(done != NULL);
+        for (unsigned long seq = order->next_reply; seq != order->next_seq; seq++) {
+            done[seq % capacity] = order->done[seq % order->capacity];
+        }
+        free(order->done);
+        order->done = done;
+        order->capacity = capacity;
+    }
+    return order->next_seq++;
+}
+
+/**
+ * Appends a reply to the replies a connection has yet to write.
+ * 
+ * @param conn  A pointer to the connection.
+ * @param data  The reply.
+ */
+void queue_reply(connection_t *conn, const data_t *data) {
+    if (conn->out_length + sizeof(*data) > conn->out_capacity) {
+        conn->out_capacity = 2 * (conn->out_length + sizeof(*data));
+        conn->out = realloc(conn->out, conn->out_capacity);
+        assert(conn->out != NULL);
+    }
+    memcpy(conn->out + conn->out_length, data, sizeof(*data));
+    conn->out_length += sizeof(*data);
+}
+
+/**
+ * Sends a reply to the message queue without waiting for room in it.
+ * 
+ * @param inbox  A pointer to the inbox.
+ * @param data   The reply.
+ * @return       0 on success, -1 if the message queue is full.
+ */
+int send_message(inbox_t *inbox, const data_t *data) {
+    // Message structure for inter-process communication
+    struct message msg;
+    // Size of the message excluding the long type
+    int msg_length = sizeof(msg) - sizeof(long);
+
+    // Set the message type for response
+    msg.mtype = 2;
+    msg.data = *data;
+
+    // Send the response message to the queue
+    if (msgsnd(inbox->msqid, &msg, msg_length, IPC_NOWAIT) == -1) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return -1;
+        }
+        perror("msgsnd");
+        exit(1);
+    }
+    return 0;
+}
+
+/**
+ * Sends the replies the message queue had no room for, oldest first, until it is full again.
+ * Called by the event loop once per batch of events.
+ * 
+ * @param inbox  A pointer to the inbox.
+ */
+void send_unsent(inbox_t *inbox) {
+    while (inbox->unsent_front != NULL && send_message(inbox, &inbox->unsent_front->data) == 0) {
+        request_t *next = inbox->unsent_front->next;
+        free(inbox->unsent_front);
+        inbox->unsent_front = next;
+    }
+}
+
+/**
+ * Sends a reply back to the message queue, or queues it on the connection it belongs to. A reply
+ * the message queue has no room for waits behind the earlier ones, so that clients which stopped
+ * reading their replies never stall the event loop.
+ * 
+ * @param server  A pointer to the server state.
+ * @param conn    A pointer to the connection, NULL for the message queue.
+ * @param data    The reply.
+ */
+void deliver_reply(server_t *server, connection_t *conn, const data_t *data) {
+    if (conn == NULL) {
+        inbox_t *inbox = server->inbox;
+
+        if (inbox->unsent_front == NULL && send_message(inbox, data) == 0) {
+            return;
+        }
+
+        request_t *reply = malloc(sizeof(request_t));
+        assert(reply != NULL);
+        reply->data = *data;
+        reply->next = NULL;
+        if (inbox->unsent_front == NULL) {
+            inbox->unsent_front = reply;
+        } else {
+            inbox->unsent_rear->next = reply;
+        }
+        inbox->unsent_rear = reply;
+    }
+
+    else if (!conn->closed) {
+        queue_reply(conn, data);
+    }
+}
+
+/**
+ * Takes a request handled by a shard and releases, in the order of the requests, every reply of
+ * its client that no longer waits for an earlier one.
+ * 
+ * @param server  A pointer to the server state.
+ * @param job     A pointer to the job of the request.
+ * @param flush   1 to write the released replies to the connection, 0 if the caller writes them.
+ */
+void release_job(server_t *server, job_t *job, int flush) {
+    connection_t *conn = job->conn;
+    reorder_t *order = conn != NULL ? &conn->order : &server->inbox->order;
+
+    order->done[job->seq % order->capacity] = job;
+
+    while ((job = order->done[order->next_reply % order->capacity]) != NULL) {
+        order->done[order->next_reply % order->capacity] = NULL;
+        order->next_reply++;
+
+        if (job->reply) {
+            deliver_reply(server, conn, &job->data);
+        }
+        if (conn != NULL) {
+            conn->inflight--;
+        }
+        free(job);
+    }
+
+    if (conn != NULL) {
+        if (conn->closed) {
+            if (conn->inflight == 0) {
+                reap_connection(server, conn);
+            }
+        } else if (flush && flush_connection(server->epfd, conn) == -1) {
+            close_connection(server, conn);
+        }
+    }
+}
+
+/**
+ * Hands a request to the shard that owns its account.
+ * 
+ * @param server  A pointer to the server state.
+ * @param job     A pointer to the job of the request.
+ */
+void dispatch_job(server_t *server, job_t *job) {
+    if (job->slot != NULL) {
+        job->slot->inflight++;
+    }
+    server->pending++;
+    send_job(server->shards[owner_shard(job->data.account.accountNo, server->shard_count)], job);
+}
+
+/**
+ * Refuses a PIN entry from a throttled client.
+ * 
+ * @param server  A pointer to the server state.
+ * @param job     A pointer to the job of the request.
+ * @param flush   1 to write the released replies to the connection, 0 if the caller writes them.
+ */
+void refuse_job(server_t *server, job_t *job, int flush) {
+    job->slot = NULL;
+    strcpy(job->data.message, "THROTTLED");
+    job->reply = 1;
+    if (server->trace != NULL) {
+        trace_end(server, &job->record, &job->data, job->reply);
+    }
+    release_job(server, job, flush);
+}
+
+/**
+ * Decides on the PIN entries a client held back while its earlier ones were on the shards, in the
+ * order they came, until one has to wait again.
+ * 
+ * @param server  A pointer to the server state.
+ * @param slot    A pointer to the throttle slot of the client.
+ */
+void release_held(server_t *server, throttle_slot_t *slot) {
+    job_t *prev = NULL;
+    job_t *job = server->held_front;
+    time_t now = time(NULL);
+
+    while (job != NULL && slot->held > 0) {
+        job_t *next = job->next;
+
+        if (job->slot != slot) {
+            prev = job;
+            job = next;
+            continue;
+        }
+
+        int outcome = throttle_admit(slot, now);
+        if (outcome == PIN_HOLD) {
+            break;
+        }
+
+        if (prev == NULL) {
+            server->held_front = next;
+        } else {
+            prev->next = next;
+        }
+        if (server->held_rear == job) {
+            server->held_rear = prev;
+        }
+        slot->held--;
+
+        if (outcome == PIN_SEND) {
+            dispatch_job(server, job);
+        } else {
+            refuse_job(server, job, 1);
+        }
+        job = next;
+    }
+}
+
+/**
+ * Takes back a job from a shard.
+ * 
+ * @param server  A pointer to the server state.
+ * @param job     A pointer to the job.
+ */
+void complete_job(server_t *server, job_t *job) {
+    if (job->kind == JOB_REQUEST) {
+        throttle_slot_t *slot = job->slot;
+
+        server->pending--;
+        if (slot != NULL) {
+            slot->inflight--;
+            if (job->failed) {
+                slot->failures++;
+            }
+        }
+        release_job(server, job, 1);
+        if (slot != NULL && slot->held > 0) {
+            release_held(server, slot);
+        }
+        return;
+    }
+
+    if (job->kind == JOB_BEGIN_RELOAD) {
+        // The data file is read once every shard logs its changes
+        if (--server->acks == 0) {
+            spawn_reload(server);
+        }
+    }
+
+    else if (job->kind == JOB_SWAP) {
+        if (job->table != NULL) {
+            retire_in_background(job->table);
+        }
+        if (--server->swaps == 0) {
+            server->reloading = 0;
+            if (job->table != NULL) {
+                printf("Reloaded the accounts of %d shards\n", server->shard_count);
+            }
+        }
+    }
+
+    free(job);
+}
+
+/**
+ * Takes back every job the shards are done with.
+ * 
+ * @param server  A pointer to the server state.
+ */
+void collect_replies(server_t *server) {
+    uint64_t count;
+    if (read(server->completion_eventfd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read");
+        exit(1);
+    }
+
+    // Clear the flag before looking at the queues, so that later replies signal again
+    __atomic_store_n(&server->notified, 0, __ATOMIC_SEQ_CST);
+
+    for (int i = 0; i < server->shard_count; i++) {
+        job_t *job;
+        while ((job = ring_pop(&server->shards[i]->replies)) != NULL) {
+            complete_job(server, job);
+        }
+    }
+}
+
+/**
+ * Handles a request on the event loop, or in shard mode steers it to the shard that owns its
+ * account. PIN entries are throttled here, since a client talks to every shard: one that could go
+ * over the limit if the entries of its client still on the shards turn out wrong waits for them.
+ * 
+ * @param server  A pointer to the server state.
+ * @param conn    A pointer to the connection the request came from, NULL for the message queue.
+ * @param data    The request.
+ */
+void submit_request(server_t *server, connection_t *conn, data_t *data) {
+    if (server->shard_count == 0) {
+        if (handle_request(server, data)) {
+            deliver_reply(server, conn, data);
+        }
+        return;
+    }
+
+    job_t *job = calloc(1, sizeof(job_t));
+    assert(job != NULL);
+    job->kind = JOB_REQUEST;
+    job->data = *data;
+    job->conn = conn;
+    job->seq = reorder_next(conn != NULL ? &conn->order : &server->inbox->order);
+
+    if (conn != NULL) {
+        conn->inflight++;
+    }
+    if (server->trace != NULL) {
+        trace_begin(server, &job->record, data);
+    }
+
+    if (is_pin_entry(&job->data)) {
+        time_t now = time(NULL);
+        job->slot = throttle_slot(server->lockout, job->data.client, now);
+
+        // Later entries of a client never overtake the ones it already holds back
+        int outcome = job->slot->held > 0 ? PIN_HOLD : throttle_admit(job->slot, now);
+
+        if (outcome == PIN_REFUSE) {
+            refuse_job(server, job, 0);
+            return;
+        }
+
+        if (outcome == PIN_HOLD) {
+            job->slot->held++;
+            job->next = NULL;
+            if (server->held_front == NULL) {
+                server->held_front = job;
+            } else {
+                server->held_rear->next = job;
+            }
+            server->held_rear = job;
+            return;
+        }
+    }
+
+    dispatch_job(server, job);
+}
+
+/**
+ * Handles every request waiting in the inbox, sending the replies to the message queue.
+ * 
+ * @param inbox   A pointer to the inbox.
+ * @param server  A pointer to the server state.
+ */
+void serve_inbox(inbox_t *inbox, server_t *server) {
+    uint64_t count;
+    if (read(inbox->eventfd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+
+    pthread_mutex_lock(&inbox->lock);
+    request_t *request = inbox->front;
+    inbox->front = NULL;
+    inbox->rear = NULL;
+    pthread_mutex_unlock(&inbox->lock);
+
+    while (request != NULL) {
+        submit_request(server, NULL, &request->data);
+
+        request_t *next = request->next;
+        free(request);
+        request = next;
+    }
+}
+
+/**
+ * Starts rebuilding the table in the background, while the current table keeps serving requests
+ * and remembers the accounts they change. In shard mode every shard starts remembering its changes
+ * first, and the data file is read once they all have.
+ * 
+ * @param server  A pointer to the server state.
+ */
+void start_reload(server_t *server) {
+    if (server->reloading) {
+        printf("A reload is already in progress\n");
+        return;
+    }
+
+    server->reloading = 1;
+
+    if (server->shard_count > 0) {
+        server->acks = server->shard_count;
+        for (int i = 0; i < server->shard_count; i++) {
+            job_t *job = calloc(1, sizeof(job_t));
+            assert(job != NULL);
+            job->kind = JOB_BEGIN_RELOAD;
+            send_job(server->shards[i], job);
+        }
+        return;
+    }
+
+    server->table->logging = 1;
+    server->table->dirty_count = 0;
+    spawn_reload(server);
+}
+
+/**
+ * Swaps in the table built by the reload thread. Accounts changed since the reload started keep
+ * their current state. The old table is freed in the background so that the swap itself only
+ * costs the changed accounts. In shard mode every shard swaps its own table between two requests.
+ * The staged file is removed once its accounts are in the data file, so that the next reload
+ * never reads it again.
+ * 
+ * @param server  A pointer to the server state.
+ */
+void finish_reload(server_t *server) {
+    uint64_t count;
+    if (read(server->reload_eventfd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+
+    if (server->shard_count > 0) {
+        // The account records journaled so far are replaced by the data file the reload wrote. The
+        // shards journal the accounts changed during the reload again when they swap
+        if (__atomic_load_n(&server->reloaded_shards[0], __ATOMIC_ACQUIRE) != NULL) {
+            journal_write_reset(server->lockout);
+        }
+
+        server->swaps = server->shard_count;
+        for (int i = 0; i < server->shard_count; i++) {
+            job_t *job = calloc(1, sizeof(job_t));
+            assert(job != NULL);
+            job->kind = JOB_SWAP;
+            job->table = __atomic_load_n(&server->reloaded_shards[i], __ATOMIC_ACQUIRE);
+            send_job(server->shards[i], job);
+        }
+        if (server->reloaded_shards[0] == NULL) {
+            printf("Reload failed, still serving the previous data\n");
+        } else {
+            unlink(server->reload_file);
+        }
+        return;
+    }
+
+    table_t *old = server->table;
+    table_t *table = __atomic_load_n(&server->reloaded, __ATOMIC_ACQUIRE);
+
+    server->reloading = 0;
+
+    if (table == NULL) {
+        old->logging = 0;
+        printf("Reload failed, still serving the previous data\n");
+        return;
+    }
+
+    int changed = carry_over(old, table, NULL);
+
+    // The reload thread wrote the data file, but requests may have rewritten it from the old table since
+    if (changed != 0) {
+        write_CSV_file(server->filename, table->queue);
+    }
+    unlink(server->reload_file);
+
+    __atomic_store_n(&server->table, table, __ATOMIC_RELEASE);
+    printf("Reloaded %d accounts, %d changed during the reload\n", table->count, changed);
+    retire_in_background(old);
+}
+
+/**
+ * Stops the server once the trace is flushed. A reload in progress is finished first, since it
+ * writes the data file too. In shard mode the requests in flight are finished first as well, and
+ * the account changes kept in the journal are written back to the data file.
+ * 
+ * @param server  A pointer to the server state.
+ */
+void stop_server(server_t *server) {
+    while (server->reloading) {
+        if (server->shard_count > 0) {
+            wake_shards(server);
+            collect_replies(server);
+        }
+        finish_reload(server);
+        usleep(1000);
+    }
+
+    if (server->shard_count > 0) {
+        while (server->pending > 0) {
+            wake_shards(server);
+            collect_replies(server);
+            usleep(1000);
+        }
+
+        queue_t *queue = read_CSV_file(server->filename);
+        if (queue != NULL) {
+            journal_replay(server->lockout, alloc_table(queue), JOURNAL_FILE, server->filename);
+        }
+    }
+
+    if (server->trace != NULL) {
+        fclose(server->trace);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * Reads the requests available on a connection, until it holds too many replies, submits every
+ * complete one and writes the replies that are ready.
+ * 
+ * @param epfd    The epoll instance.
+ * @param conn    A pointer to the connection.
+ * @param server  A pointer to the server state.
+ * @return        0 on success, -1 if the connection was closed or failed.
+ */
+int serve_connection(int epfd, connection_t *conn, server_t *server) {
+    while (!connection_full(conn)) {
+        ssize_t n = read(conn->fd, conn->in + conn->in_length, sizeof(conn->in) - conn->in_length);
+        if (n == 0) {
+            conn->eof = 1;
+            break;
+        }
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+
+        conn->in_length += n;
+        if (conn->in_length < sizeof(conn->in)) {
+            continue;
+        }
+        conn->in_length = 0;
+
+        data_t data;
+        memcpy(&data, conn->in, sizeof(data));
+        data.operation[sizeof(data.operation) - 1] = '\0';
+        data.account.accountNo[sizeof(data.account.accountNo) - 1] = '\0';
+        data.message[sizeof(data.message) - 1] = '\0';
+        data.client = conn->client;
+
+        submit_request(server, conn, &data);
+    }
+
+    return flush_connection(epfd, conn);
+}
+
+int main(int argc, char *argv[]) {
+    char *unix_path = NULL;
+    char *filename = "DataBase.csv";
+    char *reload_file = NULL;
+    char *trace_path = NULL;
+    int tcp_port = 0;
+    int shard_count = 0;
+    int opt;
+
+    // Optional socket front-ends, next to the message queue, the data file to serve, the staged file
+    // to reload it from, the trace to record and the number of shards
+    while ((opt = getopt(argc, argv, "u:t:f:R:r:s:")) != -1) {
+        if (opt == 'u') {
+            unix_path = optarg;
+        } else if (opt == 't') {
+            tcp_port = atoi(optarg);
+        } else if (opt == 'f') {
+            filename = optarg;
+        } else if (opt == 'R') {
+            reload_file = optarg;
+        } else if (opt == 'r') {
+            trace_path = optarg;
+        } else if (opt == 's') {
+            shard_count = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-u unix_socket_path] [-t tcp_port] [-f data_file] [-R reload_file] "
+                            "[-r trace_file] [-s shards]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    // The data file is rewritten by the server, so a reload reads a staged file next to it instead
+    char default_reload_file[1024];
+    if (reload_file == NULL) {
+        snprintf(default_reload_file, sizeof(default_reload_file), "%s.new", filename);
+        reload_file = default_reload_file;
+    }
+    if (strcmp(reload_file, filename) == 0) {
+        fprintf(stderr, "The reload file must differ from the data file\n");
+        exit(1);
+    }
+
+    // Generate a key based on the path to the key file
+    char abs_path[100];
+    realpath("key_file.txt", abs_path);
+    key_t key = ftok(abs_path, 1);
+
+    if (key == -1) {
+        perror("key");
+        exit(1);
+    }
+    
+    // Gets the message queue based on the key, which is optional when serving sockets
+    int msqid = msgget(key, 0);
+
+    if (msqid == -1 && unix_path == NULL && tcp_port == 0) {
+        perror("msgget");
+        exit(1);
+    }
+
+    // Initialize a queue and read data from CSV file
+    queue_t *queue = alloc_queue();
+    queue = read_CSV_file(filename);
+
+    if (queue == NULL) {
+        exit(1);
+    }
+
+    // Index the accounts and restore their lockout state
+    server_t server;
+    memset(&server, 0, sizeof(server));
+    server.filename = filename;
+    server.reload_file = reload_file;
+    server.table = alloc_table(queue);
+    server.lockout = calloc(1, sizeof(lockout_t));
+    assert(server.lockout != NULL);
+    journal_replay(server.lockout, server.table, JOURNAL_FILE, filename);
+
+    // Record the requests from now on if asked to
+    server.started = now_seconds();
+
+    if (trace_path != NULL) {
+        server.trace = fopen(trace_path, "wb");
+
+        if (server.trace == NULL) {
+            printf("Failed to open the trace.\n");
+            exit(1);
+        }
+        setvbuf(server.trace, NULL, _IOFBF, 1 << 20);
+        fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, server.trace);
+    }
+
+    // SIGHUP reloads the data file and SIGINT or SIGTERM stop the server once the trace is flushed.
+    // They are blocked before any thread starts and read from a signalfd
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK);
+    server.reload_eventfd = eventfd(0, EFD_NONBLOCK);
+
+    if (signal_fd == -1 || server.reload_eventfd == -1) {
+        perror("signalfd");
+        exit(1);
+    }
+
+    // In shard-per-core mode, pinned threads own the accounts and the event loop only steers requests
+    if (shard_count > 0) {
+        start_shards(&server, shard_count);
+    }
+
+    // Allow as many concurrent connections as the system permits
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int epfd = epoll_create1(0);
+
+    if (epfd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    server.epfd = epfd;
+
+    struct epoll_event event;
+    int unix_fd = -1;
+    int tcp_fd = -1;
+    inbox_t inbox;
+
+    event.events = EPOLLIN;
+    event.data.ptr = &signal_fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, signal_fd, &event);
+
+    event.events = EPOLLIN;
+    event.data.ptr = &server.reload_eventfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, server.reload_eventfd, &event);
+
+    if (shard_count > 0) {
+        event.events = EPOLLIN;
+        event.data.ptr = &server.completion_eventfd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, server.completion_eventfd, &event);
+    }
+
+    if (unix_path != NULL) {
+        unix_fd = listen_unix(unix_path);
+        event.events = EPOLLIN;
+        event.data.ptr = &unix_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, unix_fd, &event);
+    }
+
+    if (tcp_port != 0) {
+        tcp_fd = listen_tcp(tcp_port);
+        event.events = EPOLLIN;
+        event.data.ptr = &tcp_fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, tcp_fd, &event);
+    }
+
+    // A SysV queue cannot be polled, so a thread blocks on it and feeds the event loop through the inbox
+    if (msqid != -1) {
+        pthread_t receiver;
+
+        memset(&inbox, 0, sizeof(inbox));
+        pthread_mutex_init(&inbox.lock, NULL);
+        inbox.msqid = msqid;
+        server.inbox = &inbox;
+        inbox.eventfd = eventfd(0, EFD_NONBLOCK);
+
+        if (inbox.eventfd == -1) {
+            perror("eventfd");
+            exit(1);
+        }
+        if (pthread_create(&receiver, NULL, receive_messages, &inbox) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+
+        event.events = EPOLLIN;
+        event.data.ptr = &inbox;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, inbox.eventfd, &event);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        // Retry the replies the message queue had no room for every millisecond until they are sent
+        int timeout = server.inbox != NULL && server.inbox->unsent_front != NULL ? 1 : -1;
+        int count = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        for (int i = 0; i < count; i++) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &unix_fd || ptr == &tcp_fd) {
+                accept_connections(epfd, *(int *)ptr);
+            }
+
+            else if (ptr == &inbox) {
+                serve_inbox(&inbox, &server);
+            }
+
+            else if (ptr == &signal_fd) {
+                struct signalfd_siginfo info;
+                while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+                    if (info.ssi_signo == SIGHUP) {
+                        start_reload(&server);
+                    } else {
+                        stop_server(&server);
+                    }
+                }
+            }
+
+            else if (ptr == &server.reload_eventfd) {
+                finish_reload(&server);
+            }
+
+            else if (ptr == &server.completion_eventfd) {
+                collect_replies(&server);
+            }
+
+            else {
+                connection_t *conn = ptr;
+                int status = 0;
+
+                // Closed by an earlier event of this batch
+                if (conn->closed) {
+                    continue;
+                }
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    status = -1;
+                }
+                if (status == 0 && (events[i].events & EPOLLOUT)) {
+                    status = flush_connection(epfd, conn);
+                }
+                if (status == 0 && (events[i].events & EPOLLIN)) {
+                    status = serve_connection(epfd, conn, &server);
+                }
+                if (status == -1) {
+                    close_connection(&server, conn);
+                }
+            }
+        }
+
+        free_reaped(&server);
+
+        if (server.shard_count > 0) {
+            wake_shards(&server);
+        }
+        if (server.inbox != NULL) {
+            send_unsent(server.inbox);
+        }
+        if (server.trace != NULL) {
+            fflush(server.trace);
+        }
     }
 
     return 0;